@@ -0,0 +1,883 @@
+#include "DalyBms.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Offset between the Windows FILETIME epoch (1601-01-01) and the Unix epoch, in 100ns ticks
+#define FILETIME_UNIX_EPOCH_OFFSET                  116444736000000000LL
+
+// Serial read timeouts. A read ends once the reply is complete, this long passes between two
+// bytes, or the total timeout of constant + multiplier * requested bytes expires
+#define READ_INTERVAL_TIMEOUT_MS                    50
+#define READ_TOTAL_TIMEOUT_CONSTANT_MS              50
+#define READ_TOTAL_TIMEOUT_MULTIPLIER_MS            10
+
+// A single dropped reply shouldn't hide a pack, so discovery asks each address more than once
+#define DISCOVERY_PROBE_ATTEMPTS                    3
+#define DEFAULT_REDISCOVERY_INTERVAL_S              60
+
+// printf that only prints when the context is verbose
+#define BMS_PRINTF(ctx, ...) do { if ((ctx)->verbose) printf(__VA_ARGS__); } while (0)
+
+// Transport and scheduler internals
+static int probeBmsAddress(DalyBmsContext *ctx, int address, int attempts);
+static int addBmsPack(DalyBmsContext *ctx, int address);
+static int bmsTransact(DalyBmsContext *ctx, int address, int requestType, unsigned char *pResponse, int responseLength, long long *pRequestMonoUs);
+static int expectedReplyFrames(const BMSData *pData, int requestType);
+static int validateReply(DalyBmsContext *ctx, const BMSData *pData, int requestType, const unsigned char *pResponse, int length);
+static int startBmsCycle(DalyBmsContext *ctx, BMSData *pData);
+static int readBmsCommand(DalyBmsContext *ctx, BMSData *pData, int requestType, int notify);
+
+
+int initBmsContext(DalyBmsContext *ctx) {
+    memset(ctx, 0, sizeof(DalyBmsContext));
+    ctx->hComm = INVALID_BMS_PORT;
+    ctx->maxBmsAddress = 1;
+    ctx->hostAddressBase = DEFAULT_HOST_ADDRESS_BASE;
+    ctx->rediscoveryIntervalS = DEFAULT_REDISCOVERY_INTERVAL_S;
+    return 0;
+}
+
+int setBmsSampleCallback(DalyBmsContext *ctx, BmsSampleCallback onSample, void *pUserData) {
+    ctx->onSample = onSample;
+    ctx->pUserData = pUserData;
+    return 0;
+}
+
+int closeBmsContext(DalyBmsContext *ctx) {
+    if (ctx->hComm != INVALID_BMS_PORT) {
+        closeBmsPort(ctx->hComm);
+        ctx->hComm = INVALID_BMS_PORT;
+    }
+    ctx->numberOfPacks = 0;
+    return 0;
+}
+
+#ifdef _WIN32
+HANDLE setupCOMPort(DalyBmsContext *ctx, int portNumber) {
+    if (portNumber != -1) {
+        char comPortName[10];  // Enough space for "COM" + up to 3 digits + null terminator
+        sprintf(comPortName, "COM%d", portNumber);  // Format the COM port name
+        BMS_PRINTF(ctx, "Attempting to use COM port %d\n", portNumber);
+        HANDLE hComm = connectToCOMPort(ctx, comPortName);
+        Sleep(500);
+        if (hComm != INVALID_HANDLE_VALUE) {
+            // Check for BMS replies
+            ctx->hComm = hComm;
+            if (discoverBmsAddresses(ctx) > 0) {
+                BMS_PRINTF(ctx, "Found the target COM port: %s\n", comPortName);
+                return hComm;
+            }
+
+            BMS_PRINTF(ctx, "Error: No BMS replied on COM port %s. Aborting.\n", comPortName);
+            closeBmsContext(ctx);
+            return INVALID_HANDLE_VALUE;
+        } else {
+            BMS_PRINTF(ctx, "Error: Unable to open COM port %s. Aborting.\n", comPortName);
+            return INVALID_HANDLE_VALUE;
+        }
+    } else {
+        BMS_PRINTF(ctx, "No COM port supplied. Searching for a COM port... \n");
+        for (int i = 1; i <= 256; ++i) {
+            char comPortName[10];  // Enough space for "COM" + up to 3 digits + null terminator
+            sprintf(comPortName, "COM%d", i);  // Format the COM port name
+            HANDLE hComm = connectToCOMPort(ctx, comPortName);
+            Sleep(500);
+            if (hComm != INVALID_HANDLE_VALUE) {
+                // Check for BMS replies
+                ctx->hComm = hComm;
+                if (discoverBmsAddresses(ctx) > 0) {
+                    BMS_PRINTF(ctx, "Found the target COM port: %s\n", comPortName);
+                    return hComm;
+                }
+
+                // Close the handle if this isn't the correct one
+                closeBmsContext(ctx);
+            } else {
+                BMS_PRINTF(ctx, "Unable to open COM port %s\n", comPortName);
+            }
+        }
+    
+    }
+    return INVALID_HANDLE_VALUE;
+}
+
+HANDLE connectToCOMPort(DalyBmsContext *ctx, const char *portName) {
+    BMS_PRINTF(ctx, "Trying port %s\n", portName);
+    DCB dcbSerialParams = {0};
+    COMMTIMEOUTS timeouts = {0};
+    
+    HANDLE hComm = CreateFile(portName,
+                              GENERIC_READ | GENERIC_WRITE,
+                              0,
+                              NULL,
+                              OPEN_EXISTING,
+                              0,
+                              NULL);
+
+    if (hComm == INVALID_HANDLE_VALUE) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    dcbSerialParams.DCBlength = sizeof(DCB);
+
+    if (!GetCommState(hComm, &dcbSerialParams)) {
+        BMS_PRINTF(ctx, "Error getting current DCB settings\n");
+        CloseHandle(hComm);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    dcbSerialParams.BaudRate = CBR_9600;
+    dcbSerialParams.ByteSize = 8;
+    dcbSerialParams.StopBits = ONESTOPBIT;
+    dcbSerialParams.Parity   = NOPARITY;
+
+    if (!SetCommState(hComm, &dcbSerialParams)) {
+        BMS_PRINTF(ctx, "Could not set serial port parameters\n");
+        CloseHandle(hComm);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    timeouts.ReadIntervalTimeout         = READ_INTERVAL_TIMEOUT_MS;
+    timeouts.ReadTotalTimeoutConstant    = READ_TOTAL_TIMEOUT_CONSTANT_MS;
+    timeouts.ReadTotalTimeoutMultiplier  = READ_TOTAL_TIMEOUT_MULTIPLIER_MS;
+    timeouts.WriteTotalTimeoutConstant   = 50;
+    timeouts.WriteTotalTimeoutMultiplier = 10;
+
+    if (!SetCommTimeouts(hComm, &timeouts)) {
+        BMS_PRINTF(ctx, "Could not set serial port timeouts\n");
+        CloseHandle(hComm);
+        return INVALID_HANDLE_VALUE;
+    }
+    return hComm;
+}
+
+int closeBmsPort(BmsPort hComm) {
+    return CloseHandle(hComm) ? 0 : -1;
+}
+
+int purgeBmsPort(BmsPort hComm) {
+    return PurgeComm(hComm, PURGE_RXCLEAR | PURGE_TXCLEAR) ? 0 : -1;
+}
+
+int writeBmsPort(BmsPort hComm, const unsigned char *pData, int length) {
+    DWORD bytesWritten;
+    if (!WriteFile(hComm, pData, length, &bytesWritten, NULL)) {
+        return -1;
+    }
+    return (int)bytesWritten;
+}
+
+// Returns once length bytes have arrived or the COMMTIMEOUTS set in connectToCOMPort expire
+int readBmsPort(BmsPort hComm, unsigned char *pData, int length) {
+    DWORD bytesRead;
+    if (!ReadFile(hComm, pData, length, &bytesRead, NULL)) {
+        return -1;
+    }
+    return (int)bytesRead;
+}
+#else
+BmsPort connectToCOMPort(DalyBmsContext *ctx, const char *portName) {
+    BMS_PRINTF(ctx, "Trying port %s\n", portName);
+
+    int fd = open(portName, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return INVALID_BMS_PORT;
+    }
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0) {
+        BMS_PRINTF(ctx, "Error getting current serial settings\n");
+        close(fd);
+        return INVALID_BMS_PORT;
+    }
+
+    // 9600 8N1, raw bytes
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, B9600);
+    cfsetospeed(&tty, B9600);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | PARENB);
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        BMS_PRINTF(ctx, "Could not set serial port parameters\n");
+        close(fd);
+        return INVALID_BMS_PORT;
+    }
+    return fd;
+}
+
+int closeBmsPort(BmsPort hComm) {
+    return close(hComm);
+}
+
+int purgeBmsPort(BmsPort hComm) {
+    return tcflush(hComm, TCIOFLUSH);
+}
+
+int writeBmsPort(BmsPort hComm, const unsigned char *pData, int length) {
+    int written = 0;
+    while (written < length) {
+        ssize_t n = write(hComm, pData + written, length - written);
+        if (n < 0) {
+            return -1;
+        }
+        written += (int)n;
+    }
+    return written;
+}
+
+// Same semantics as ReadFile with the COMMTIMEOUTS used on Windows: returns once length bytes have
+// arrived, READ_INTERVAL_TIMEOUT_MS passes between two bytes, or the total timeout expires
+int readBmsPort(BmsPort hComm, unsigned char *pData, int length) {
+    long long deadline = getMonotonicUs() +
+        (READ_TOTAL_TIMEOUT_CONSTANT_MS + (long long)READ_TOTAL_TIMEOUT_MULTIPLIER_MS * length) * 1000;
+    int nRead = 0;
+
+    while (nRead < length) {
+        int timeoutMs = (int)((deadline - getMonotonicUs()) / 1000);
+        if (nRead > 0 && timeoutMs > READ_INTERVAL_TIMEOUT_MS) {
+            timeoutMs = READ_INTERVAL_TIMEOUT_MS;
+        }
+        if (timeoutMs <= 0) {
+            break;
+        }
+
+        struct pollfd pfd = {hComm, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready < 0) {
+            return -1;
+        }
+        if (ready == 0) {
+            break;
+        }
+
+        ssize_t n = read(hComm, pData + nRead, length - nRead);
+        if (n <= 0) {
+            return nRead > 0 ? nRead : -1;
+        }
+        nRead += (int)n;
+    }
+    return nRead;
+}
+#endif
+
+// Probes BMS addresses 1 to ctx->maxBmsAddress with 0x90 and adds each one that replies to packs[].
+// Returns the number of packs found
+int discoverBmsAddresses(DalyBmsContext *ctx) {
+    ctx->numberOfPacks = 0;
+    for (int address = 1; address <= ctx->maxBmsAddress; address++) {
+        if (probeBmsAddress(ctx, address, DISCOVERY_PROBE_ATTEMPTS)) {
+            addBmsPack(ctx, address);
+        }
+    }
+    ctx->lastDiscoveryMonoUs = getMonotonicUs();
+    return ctx->numberOfPacks;
+}
+
+// Probes the addresses discovery didn't find once more, so a pack that missed its probes or was
+// powered up later joins the bus. New packs are appended, packs[] indices of existing ones don't
+// change. Returns the number of packs added
+int rediscoverBmsAddresses(DalyBmsContext *ctx) {
+    int nAdded = 0;
+
+    for (int address = 1; address <= ctx->maxBmsAddress; address++) {
+        int known = 0;
+        for (int p = 0; p < ctx->numberOfPacks; p++) {
+            if (ctx->packs[p].batteryID == address) {
+                known = 1;
+            }
+        }
+
+        if (!known && probeBmsAddress(ctx, address, 1)) {
+            addBmsPack(ctx, address);
+            nAdded++;
+        }
+    }
+    ctx->lastDiscoveryMonoUs = getMonotonicUs();
+    return nAdded;
+}
+
+// Returns 1 if the address answered 0x90 with a valid frame within the given number of attempts
+static int probeBmsAddress(DalyBmsContext *ctx, int address, int attempts) {
+    unsigned char response[FRAME_LENGTH];
+    BMSData probe;
+    probe.batteryID = address;
+
+    for (int i = 0; i < attempts; i++) {
+        int bytesRead = bmsTransact(ctx, address, READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC, response, sizeof(response), NULL);
+        if (bytesRead == FRAME_LENGTH && validateReply(ctx, &probe, READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC, response, bytesRead)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int addBmsPack(DalyBmsContext *ctx, int address) {
+    if (ctx->numberOfPacks >= G_MAX_NUMBER_OF_PACKS) {
+        return 0;
+    }
+
+    BMSData *pData = &ctx->packs[ctx->numberOfPacks++];
+    memset(pData, 0, sizeof(BMSData));
+    pData->batteryID = address;
+    pData->numberOfBatteryCells = -1;
+    pData->numberOfTempSensors = -1;
+    BMS_PRINTF(ctx, "Found BMS at address %d\n", address);
+    return 1;
+}
+
+// Sends one request to a BMS address and reads its reply. Only one transaction is ever on the
+// half-duplex bus at a time. Reading exactly the expected length lets ReadFile return as soon as
+// the reply is complete, so the next request goes out without waiting for the read timeout.
+// If pRequestMonoUs isn't NULL it receives the monotonic time the request was sent.
+// Returns the number of bytes read, or -1 on error
+static int bmsTransact(DalyBmsContext *ctx, int address, int requestType, unsigned char *pResponse, int responseLength, long long *pRequestMonoUs) {
+    unsigned char request[FRAME_LENGTH] = {0xA5, (ctx->hostAddressBase + address) & 0xFF, requestType, 0x08};
+
+    // Checksum is the low byte of the sum of every byte before it
+    int checksum = 0;
+    for (int i = 0; i < FRAME_LENGTH - 1; i++) {
+        checksum += request[i];
+    }
+    request[FRAME_LENGTH - 1] = checksum & 0xFF;
+
+    // Drop anything left on the line, e.g. a late reply from the previous address
+    purgeBmsPort(ctx->hComm);
+
+    int bytesWritten = writeBmsPort(ctx->hComm, request, FRAME_LENGTH);
+    if (bytesWritten < 0) {
+        BMS_PRINTF(ctx, "Could not write data to port\n");
+        return -1;
+    }
+    BMS_PRINTF(ctx, "Data written to address %d, %d bytes\n", address, bytesWritten);
+
+    // The BMS samples when the request arrives, not when its reply has finished going out. A
+    // 48-cell 0x95 reply takes over 200ms on the wire, so stamping after the read would skew it
+    // against the single-frame commands
+    if (pRequestMonoUs != NULL) {
+        *pRequestMonoUs = getMonotonicUs();
+    }
+
+    int bytesRead = readBmsPort(ctx->hComm, pResponse, responseLength);
+    if (bytesRead < 0) {
+        BMS_PRINTF(ctx, "Could not read data from port\n");
+        return -1;
+    }
+    return bytesRead;
+}
+
+// Number of reply frames a request produces, or 0 if it isn't known yet. 0x95 and 0x96 need the
+// cell and sensor counts from 0x94
+static int expectedReplyFrames(const BMSData *pData, int requestType) {
+    const int CELLS_PER_FRAME = 3;
+    const int SENSORS_PER_FRAME = 7;
+
+    if (requestType == READ_BAT_SINGLE_CELL_VOLTAGE) {
+        return pData->numberOfBatteryCells > 0 ? (pData->numberOfBatteryCells + CELLS_PER_FRAME - 1) / CELLS_PER_FRAME : 0;
+    }
+    if (requestType == READ_BAT_SINGLE_CELL_TEMP) {
+        return pData->numberOfTempSensors > 0 ? (pData->numberOfTempSensors + SENSORS_PER_FRAME - 1) / SENSORS_PER_FRAME : 0;
+    }
+    return 1;
+}
+
+// Checks every complete frame in a reply for the start flag, the pack's address, the command and
+// the checksum, so a reply can only ever be routed to the pack that sent it
+static int validateReply(DalyBmsContext *ctx, const BMSData *pData, int requestType, const unsigned char *pResponse, int length) {
+    if (length < FRAME_LENGTH) {
+        BMS_PRINTF(ctx, "Reply from address %d too short, %d bytes\n", pData->batteryID, length);
+        return 0;
+    }
+
+    for (int frame = 0; frame + FRAME_LENGTH <= length; frame += FRAME_LENGTH) {
+        const unsigned char *pFrame = pResponse + frame;
+        if (pFrame[0] != 0xA5 || pFrame[2] != requestType) {
+            BMS_PRINTF(ctx, "Malformed reply frame from address %d\n", pData->batteryID);
+            return 0;
+        }
+        if (pFrame[1] != pData->batteryID) {
+            BMS_PRINTF(ctx, "Reply from address %d while polling address %d, discarded\n", pFrame[1], pData->batteryID);
+            return 0;
+        }
+
+        int checksum = 0;
+        for (int i = 0; i < FRAME_LENGTH - 1; i++) {
+            checksum += pFrame[i];
+        }
+        if ((checksum & 0xFF) != pFrame[FRAME_LENGTH - 1]) {
+            BMS_PRINTF(ctx, "Checksum mismatch in reply from address %d\n", pData->batteryID);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Bus scheduler. Commands are interleaved across packs (every pack's 0x90, then every pack's 0x91,
+// ...) so the same quantity is read from each pack within a few milliseconds of each other.
+// With alignSamples, a pack's 0x90 moves next to its 0x95 and is polled again right after, so the
+// interpolation only spans one 0x95 transaction rather than the whole bus cycle.
+int pollAllPacks(DalyBmsContext *ctx) {
+    if (ctx->rediscoveryIntervalS > 0 && ctx->numberOfPacks < ctx->maxBmsAddress &&
+        getMonotonicUs() - ctx->lastDiscoveryMonoUs >= (long long)ctx->rediscoveryIntervalS * 1000000) {
+        rediscoverBmsAddresses(ctx);
+    }
+
+    for (int p = 0; p < ctx->numberOfPacks; p++) {
+        startBmsCycle(ctx, &ctx->packs[p]);
+    }
+
+    for (int requestType = READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC; requestType <= READ_BAT_SINGLE_CELL_FAILURE_STATUS; requestType++) {
+        for (int p = 0; p < ctx->numberOfPacks; p++) {
+            if (ctx->alignSamples && requestType == READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC) {
+                continue;  // Read right before 0x95 instead
+            }
+            if (ctx->alignSamples && requestType == READ_BAT_SINGLE_CELL_VOLTAGE) {
+                getBMSData(ctx, &ctx->packs[p], READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC);
+                getBMSData(ctx, &ctx->packs[p], READ_BAT_SINGLE_CELL_VOLTAGE);
+                alignCurrentVoltage(ctx, &ctx->packs[p]);
+                continue;
+            }
+            getBMSData(ctx, &ctx->packs[p], requestType);
+        }
+    }
+
+    for (int p = 0; p < ctx->numberOfPacks; p++) {
+        if (ctx->onSample != NULL) {
+            ctx->onSample(&ctx->packs[p], BMS_CYCLE_COMPLETE, ctx->pUserData);
+        }
+    }
+    return 0;
+}
+
+static int startBmsCycle(DalyBmsContext *ctx, BMSData *pData) {
+    // Anchor the monotonic clock to the wall clock once per cycle. Replies are stamped with the
+    // monotonic clock only and converted to UTC relative to this anchor.
+    pData->cycleStartMonoUs = getMonotonicUs();
+    pData->cycleStartEpochUs = getEpochUs();
+    pData->sampleMonoUs = pData->cycleStartMonoUs;
+
+    for (int i = 0; i < G_NUMBER_OF_COMMANDS; i++) {
+        pData->commandMonoUs[i] = 0;
+    }
+
+    BMS_PRINTF(ctx, "\n\nPolling BMS address %d\n", pData->batteryID);
+    return 0;
+}
+
+#ifdef _WIN32
+long long getMonotonicUs() {
+    // The counter frequency is fixed at boot, so it is safe to share between contexts
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+
+    // Split the conversion so counter * 1000000 can't overflow
+    long long seconds = counter.QuadPart / frequency.QuadPart;
+    long long remainder = counter.QuadPart % frequency.QuadPart;
+    return seconds * 1000000LL + remainder * 1000000LL / frequency.QuadPart;
+}
+
+long long getEpochUs() {
+    FILETIME fileTime;
+    GetSystemTimeAsFileTime(&fileTime);
+
+    long long ticks = ((long long)fileTime.dwHighDateTime << 32) | fileTime.dwLowDateTime;
+    return (ticks - FILETIME_UNIX_EPOCH_OFFSET) / 10;
+}
+#else
+long long getMonotonicUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+long long getEpochUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+#endif
+
+long long monotonicToEpochUs(const BMSData *pData, long long monotonicUs) {
+    return pData->cycleStartEpochUs + (monotonicUs - pData->cycleStartMonoUs);
+}
+
+// Polls 0x90 a second time and linearly interpolates current and voltage to the instant the cell
+// voltages (0x95) were read, so every value in the row describes the same moment. Called by the
+// scheduler straight after a 0x90 / 0x95 pair, so the two 0x90 replies bracket 0x95 closely.
+int alignCurrentVoltage(DalyBmsContext *ctx, BMSData *pData) {
+    const int SOC_INDEX = READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC;
+    const int CELL_VOLTAGE_INDEX = READ_BAT_SINGLE_CELL_VOLTAGE - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC;
+
+    long long t0 = pData->commandMonoUs[SOC_INDEX];
+    long long target = pData->commandMonoUs[CELL_VOLTAGE_INDEX];
+    float current0 = pData->current;
+    float voltage0 = pData->voltage;
+    float soc0 = pData->stateOfCharge;
+
+    if (t0 == 0 || target == 0) {
+        BMS_PRINTF(ctx, "Alignment skipped, missing 0x90 or 0x95 reply\n");
+        return 0;
+    }
+
+    // The second 0x90 only feeds the interpolation. Applications get the aligned values with
+    // BMS_CYCLE_COMPLETE, so don't hand them this raw reading as if it were another 0x90 sample
+    pData->commandMonoUs[SOC_INDEX] = 0;
+    readBmsCommand(ctx, pData, READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC, 0);
+    long long t1 = pData->commandMonoUs[SOC_INDEX];
+
+    if (t1 <= t0) {
+        BMS_PRINTF(ctx, "Alignment skipped, second 0x90 reply missing\n");
+        pData->commandMonoUs[SOC_INDEX] = t0;
+        pData->current = current0;
+        pData->voltage = voltage0;
+        pData->stateOfCharge = soc0;
+        return 0;
+    }
+
+    float fraction = (float)(target - t0) / (float)(t1 - t0);
+    pData->current = current0 + (pData->current - current0) * fraction;
+    pData->voltage = voltage0 + (pData->voltage - voltage0) * fraction;
+    pData->stateOfCharge = soc0;  // SOC moves far too slowly to be worth interpolating
+    pData->commandMonoUs[SOC_INDEX] = t0;
+    pData->sampleMonoUs = target;
+
+    BMS_PRINTF(ctx, "aligned current: %.2fA\n", pData->current);
+    BMS_PRINTF(ctx, "aligned voltage: %.2fV\n", pData->voltage);
+    return 1;
+}
+
+int getBMSData(DalyBmsContext *ctx, BMSData *pData, int requestType) {
+    return readBmsCommand(ctx, pData, requestType, 1);
+}
+
+// Sends one command and decodes the reply into pData. The decoded sample is only handed to the
+// application's callback when notify is set
+static int readBmsCommand(DalyBmsContext *ctx, BMSData *pData, int requestType, int notify) {
+    unsigned char pResponse[300];
+
+    if (requestType < READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC || requestType > READ_BAT_SINGLE_CELL_FAILURE_STATUS) {
+        return 0;
+    }
+
+    // Read exactly the expected frames when known, otherwise until the read times out
+    int nFrames = expectedReplyFrames(pData, requestType);
+    int responseLength = nFrames > 0 ? nFrames * FRAME_LENGTH : (int)sizeof(pResponse);
+
+    const int MAX_RETRY = 1;
+
+    for (int i = 0; i < MAX_RETRY; i++) {
+        long long requestMonoUs = 0;
+        int bytesRead = bmsTransact(ctx, pData->batteryID, requestType, pResponse, responseLength, &requestMonoUs);
+
+        if (bytesRead > 0) {
+            BMS_PRINTF(ctx, "Data read from port: ");
+            for (int i = 0; i < bytesRead; i++) {
+                BMS_PRINTF(ctx, "%02X ", pResponse[i]);
+            }
+            BMS_PRINTF(ctx, "\n");
+        }
+
+        if (bytesRead <= 0 || !validateReply(ctx, pData, requestType, pResponse, bytesRead)) {
+            continue;
+        }
+        if (nFrames > 0 && bytesRead < responseLength) {
+            BMS_PRINTF(ctx, "Reply from address %d incomplete, %d of %d bytes\n", pData->batteryID, bytesRead, responseLength);
+            continue;
+        }
+
+        int parsed = 0;
+        switch( pResponse[2] ) {
+            case READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC:
+                parsed = parseBmsResponseSoc(ctx, pData, pResponse);
+                break;
+            case READ_BAT_HIGHEST_LOWEST_VOLTAGE:
+                parsed = parseBmsResponseHighestLowestVoltage(ctx, pData, pResponse);
+                break;
+            case READ_BAT_MAX_MIN_TEMP:
+                parsed = parseBmsResponseMaxMinTemp(ctx, pData, pResponse);
+                break;
+            case READ_BAT_CHARGE_DISCHARGE_MOS_STATUS:
+                parsed = parseBmsResponseChargeDischargeMosStatus(ctx, pData, pResponse);
+                break;
+            case READ_BAT_STATUS_INFO_1:
+                parsed = parseBmsResponseStatusInfo1(ctx, pData, pResponse);
+                break;
+            case READ_BAT_SINGLE_CELL_VOLTAGE:
+                parsed = parseBmsResponseSingleCellVoltage(ctx, pData, pResponse);
+                break;
+            case READ_BAT_SINGLE_CELL_TEMP:
+                parsed = parseBmsResponseSingleCellTemp(ctx, pData, pResponse);
+                break;
+            case READ_BAT_SINGLE_CELL_BALANCE_STATUS:
+                parsed = parseBmsResponseSingleCellBalancingStatus(ctx, pData, pResponse);
+                break;
+            case READ_BAT_SINGLE_CELL_FAILURE_STATUS:
+                parsed = parseBmsResponseBatteryFailureStatus(ctx, pData, pResponse);
+                break;
+            default:
+                return 0;
+            }
+        if (!parsed) {
+            continue;
+        }
+        pData->commandMonoUs[requestType - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC] = requestMonoUs;
+
+        // Hand the decoded sample straight to the application
+        if (notify && ctx->onSample != NULL) {
+            ctx->onSample(pData, requestType, ctx->pUserData);
+        }
+        return 1;
+    }
+    return 0;
+
+}
+
+int parseBmsResponseSoc(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+    float cumulative_total_voltage = ((pResponse[4] << 8) + pResponse[5]) * 0.1f;
+    float collect_total_voltage = ((pResponse[6] << 8) + pResponse[7]) * 0.1f;
+    float current = (((pResponse[8] << 8) + pResponse[9]) - 30000) * 0.1f;
+    float soc = ((pResponse[10] << 8) + pResponse[11]) * 0.1f;
+
+    pData->voltage = cumulative_total_voltage;
+    pData->current = current;
+    pData->stateOfCharge = soc;
+
+    BMS_PRINTF(ctx, "cumulative_total_voltage: %.2fV\n", cumulative_total_voltage);
+    BMS_PRINTF(ctx, "collect_total_voltage: %.2fV\n", collect_total_voltage);
+    BMS_PRINTF(ctx, "current: %.2fA\n", current);
+    BMS_PRINTF(ctx, "soc: %.2f%%\n", soc);
+    return 1;
+}
+
+int parseBmsResponseHighestLowestVoltage(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+    float highest_single_voltage = (pResponse[4] << 8) + pResponse[5];
+    int highest_voltage_cell_number = pResponse[6];
+    float lowest_single_voltage = (pResponse[7] << 8) + pResponse[8];
+    int lowest_voltage_cell_number = pResponse[9];
+
+    pData->highestCellVoltage = highest_single_voltage;
+    pData->lowestCellVoltage = lowest_single_voltage;
+
+    BMS_PRINTF(ctx, "highest_single_voltage: %.2fmV\n", highest_single_voltage);
+    BMS_PRINTF(ctx, "highest_voltage_cell_number: %d\n", highest_voltage_cell_number);
+    BMS_PRINTF(ctx, "lowest_single_voltage: %.2fmV\n", lowest_single_voltage);
+    BMS_PRINTF(ctx, "lowest_voltage_cell_number: %d\n", lowest_voltage_cell_number);
+    return 1;
+}
+
+int parseBmsResponseMaxMinTemp(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    (void)pData;  // Only logged, BMSData has no fields for these
+    // Data bits start at index 4
+    float max_temp = pResponse[4] - 40;
+    int max_temp_cell_number = pResponse[5];
+    float min_temp = pResponse[6] - 40;
+    int min_temp_cell_number = pResponse[7];
+
+    BMS_PRINTF(ctx, "max_temp: %.2fC\n", max_temp);
+    BMS_PRINTF(ctx, "max_temp_cell_number: %d\n", max_temp_cell_number);
+    BMS_PRINTF(ctx, "min_temp: %.2fC\n", min_temp);
+    BMS_PRINTF(ctx, "min_temp_cell_number: %d\n", min_temp_cell_number);
+    return 1;
+}
+
+int parseBmsResponseChargeDischargeMosStatus(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+    int charge_discharge_status = pResponse[4];
+    int mos_tube_charging_status = pResponse[5];
+    int mos_tube_discharging_status = pResponse[6];
+    int bms_life = pResponse[7];
+    int remaining_capacity = (pResponse[8] << 24) | (pResponse[9] << 16) | (pResponse[10] << 8) | pResponse[11];
+
+    pData->chargingDischargingStatus = charge_discharge_status;
+    pData->chargingMOSStatus = mos_tube_charging_status;
+    pData->dischargingMOSStatus = mos_tube_discharging_status;
+
+    pData->remainingCapacity = remaining_capacity;
+
+    BMS_PRINTF(ctx, "charge_discharge_status: %d\n", charge_discharge_status);
+    BMS_PRINTF(ctx, "mos_tube_charging_status: %d\n", mos_tube_charging_status);
+    BMS_PRINTF(ctx, "mos_tube_discharging_status: %d\n", mos_tube_discharging_status);
+    BMS_PRINTF(ctx, "bms_life: %d\n", bms_life);
+    BMS_PRINTF(ctx, "remaining_capacity: %dmAH\n", remaining_capacity);
+    return 1;
+}
+
+int parseBmsResponseStatusInfo1(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+    int battery_strings = pResponse[4];
+    int number_of_temperature = pResponse[5];
+    int charger_status = pResponse[6];
+    int load_status = pResponse[7];
+    int states = pResponse[8];
+
+    int DI1_state = (states >> 0) & 1;
+    int DI2_state = (states >> 1) & 1;
+    int DI3_state = (states >> 2) & 1;
+    int DI4_state = (states >> 3) & 1;
+    int DO1_state = (states >> 4) & 1;
+    int DO2_state = (states >> 5) & 1;
+    int DO3_state = (states >> 6) & 1;
+    int DO4_state = (states >> 7) & 1;
+
+    // Never trust the BMS to stay within the arrays
+    pData->numberOfBatteryCells = battery_strings < G_MAX_NUMBER_OF_CELLS ? battery_strings : G_MAX_NUMBER_OF_CELLS;
+    pData->numberOfTempSensors = number_of_temperature < G_MAX_NUMBER_OF_TEMP_SENSORS ? number_of_temperature : G_MAX_NUMBER_OF_TEMP_SENSORS;
+
+    BMS_PRINTF(ctx, "battery_strings: %d\n", battery_strings);
+    BMS_PRINTF(ctx, "number_of_temperature: %d\n", number_of_temperature);
+    BMS_PRINTF(ctx, "charger_status: %d\n", charger_status);
+    BMS_PRINTF(ctx, "load_status: %d\n", load_status);
+    BMS_PRINTF(ctx, "DI1_state: %d\n", DI1_state);
+    BMS_PRINTF(ctx, "DI2_state: %d\n", DI2_state);
+    BMS_PRINTF(ctx, "DI3_state: %d\n", DI3_state);
+    BMS_PRINTF(ctx, "DI4_state: %d\n", DI4_state);
+    BMS_PRINTF(ctx, "DO1_state: %d\n", DO1_state);
+    BMS_PRINTF(ctx, "DO2_state: %d\n", DO2_state);
+    BMS_PRINTF(ctx, "DO3_state: %d\n", DO3_state);
+    BMS_PRINTF(ctx, "DO4_state: %d\n", DO4_state);
+    return 1;
+}
+
+int parseBmsResponseSingleCellVoltage(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+
+    float cell_voltages[G_MAX_NUMBER_OF_CELLS];
+
+    const int MESSAGE_LENGTH = 13;
+    const int MAX_FRAMES = 16;
+    const int CELLS_PER_FRAME = 3;
+
+    int nCellsRead = 0; // number of battery cells read
+    int readIndex = 4;
+
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        // The cell count is -1 until 0x94 has been read, so never run past the array either
+        if (nCellsRead == pData->numberOfBatteryCells || nCellsRead == G_MAX_NUMBER_OF_CELLS) {
+            break;
+        }
+
+        // check if frame number is correct
+        int frame_number = pResponse[4 + i * MESSAGE_LENGTH];
+        if (frame_number != i + 1) { // Frames are 1-indexed. i is 0-indexed
+            BMS_PRINTF(ctx, "Frame number incorrect\n");
+            continue;
+        }
+
+        readIndex = i * MESSAGE_LENGTH + 4 + 1; // 4 for the start flage, bms address, command, and data length. 1 for byte 0 being the frame serial number
+
+        for (int j = 0; j < CELLS_PER_FRAME; j++) {
+            if (nCellsRead == pData->numberOfBatteryCells || nCellsRead == G_MAX_NUMBER_OF_CELLS) {
+                break;
+            }
+            cell_voltages[nCellsRead] = (pResponse[readIndex] << 8) + pResponse[readIndex + 1];
+
+            pData->cellVoltage[nCellsRead] = cell_voltages[nCellsRead];
+
+            BMS_PRINTF(ctx, "cell_voltages[%d]: %.2fmV\n", nCellsRead, cell_voltages[nCellsRead]);
+            nCellsRead++;
+            readIndex += 2;
+        }
+    }
+    return nCellsRead > 0;
+}
+
+int parseBmsResponseSingleCellTemp(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    int cell_temps[G_MAX_NUMBER_OF_CELLS];
+
+    const int MESSAGE_LENGTH = 13;
+    const int MAX_FRAMES = 3;
+    const int CELLS_PER_FRAME = 7;
+    const int TEMPERATURE_OFFSET = 40;
+
+    int nRead = 0; // number of temperature sensors read
+    // Data bits start at index 4
+    int readIndex = 4;
+
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        // The sensor count is -1 until 0x94 has been read, so never run past the array either
+        if (nRead == pData->numberOfTempSensors || nRead == G_MAX_NUMBER_OF_TEMP_SENSORS) {
+            break;
+        }
+
+        // check if frame number is correct
+        int frame_number = pResponse[4 + i * MESSAGE_LENGTH];
+        if (frame_number != i + 1) { // Frames are 1-indexed. i is 0-indexed
+            BMS_PRINTF(ctx, "Frame number incorrect\n");
+            continue;
+        }
+
+        readIndex = i * MESSAGE_LENGTH + 4 + 1; // 4 for the start flage, bms address, command, and data length. 1 for byte 0 being the frame serial number
+
+        for (int j = 0; j < CELLS_PER_FRAME; j++) {
+            if (nRead == pData->numberOfTempSensors || nRead == G_MAX_NUMBER_OF_TEMP_SENSORS) {
+                break;
+            }
+            cell_temps[nRead] = pResponse[readIndex] - TEMPERATURE_OFFSET;
+
+            pData->temperatures[nRead] = cell_temps[nRead];
+
+            BMS_PRINTF(ctx, "cell_temps[%d]: %dC\n", nRead, cell_temps[nRead]);
+            nRead++;
+            readIndex++;
+        }
+    }
+    return nRead > 0;
+}
+
+int parseBmsResponseSingleCellBalancingStatus(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+    // One bit per cell across the 8 data bytes. Bit 0 of byte 0 is cell 1
+
+    int isBalancing = 0;
+
+    for (int i = 0; i < pData->numberOfBatteryCells; i++) {
+        pData->cellBalancingStatus[i] = (pResponse[4 + i / 8] >> (i % 8)) & 1;
+        isBalancing = isBalancing || pData->cellBalancingStatus[i];
+    }
+
+    for (int i = 0; i < pData->numberOfBatteryCells; i++) {
+        BMS_PRINTF(ctx, "cellBalancingStatus[%d]: %d\n", i, pData->cellBalancingStatus[i]);
+    }
+
+
+    pData->balancingStatus = isBalancing;
+    return 1;
+}
+
+int parseBmsResponseBatteryFailureStatus(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse) {
+    // Data bits start at index 4
+    // Alarms' are stored in reverse bit order. I.e. alarms[i][0] is the alarm of the ith byte, last bit
+
+    char alarms[8][9];  // 8 bytes, each with 8 bits + null-terminator
+    
+    for (int i = 0; i < 8; ++i) {
+        int byte = pResponse[4 + i];  // start from pResponse[4]
+        char *currentString = alarms[i];
+        
+        for (int j = 7; j >= 0; --j) {  // loop through each bit in byte
+            currentString[j] = ((byte >> j) & 1) ? '1' : '0';
+        }
+        currentString[8] = '\0';  // null-terminate the string
+    }
+    
+    for (int i = 0; i < 8; ++i) {
+        strcpy(pData->alarms[i], alarms[i]);
+        BMS_PRINTF(ctx, "Binary string for byte %d: %s\n", i, alarms[i]);
+    }
+    return 1;
+}
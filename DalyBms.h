@@ -0,0 +1,132 @@
+#ifndef DALY_BMS_H
+#define DALY_BMS_H
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE BmsPort;
+#define INVALID_BMS_PORT                            INVALID_HANDLE_VALUE
+#else
+// POSIX serial devices and pseudo-terminals, used by the simulator test harness
+typedef int BmsPort;
+#define INVALID_BMS_PORT                            (-1)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC		    0x90
+#define READ_BAT_HIGHEST_LOWEST_VOLTAGE		        0x91
+#define READ_BAT_MAX_MIN_TEMP		                0x92
+#define READ_BAT_CHARGE_DISCHARGE_MOS_STATUS		0x93
+#define READ_BAT_STATUS_INFO_1		                0x94
+#define READ_BAT_SINGLE_CELL_VOLTAGE		        0x95
+#define READ_BAT_SINGLE_CELL_TEMP		            0x96
+#define READ_BAT_SINGLE_CELL_BALANCE_STATUS		    0x97
+#define READ_BAT_SINGLE_CELL_FAILURE_STATUS		    0x98
+
+// Passed to the sample callback once a pack's cycle is complete, after alignment
+#define BMS_CYCLE_COMPLETE                          0x00
+
+
+#define G_MAX_NUMBER_OF_CELLS                       48  // 16 frames of 3 cells in the 0x95 reply
+#define G_MAX_NUMBER_OF_TEMP_SENSORS                4
+#define G_NUMBER_OF_COMMANDS                        9   // 0x90 to 0x98
+#define G_MAX_NUMBER_OF_PACKS                       16  // BMS addresses 1 to 16 can share one bus
+#define FRAME_LENGTH                                13  // Every request and reply frame is 13 bytes
+// Byte 1 of a request. The Daly protocol defines it as the sender, 0x40 for a PC, and a reply
+// carries the BMS's own address there. Reaching BMS address n on a shared RS-485 bus by sending
+// hostAddressBase + n is an assumption that has NOT been verified against Daly firmware. With one
+// pack at address 1 the request is the documented 0x40 either way. Boards that use another scheme
+// can set hostAddressBase in the context
+#define DALY_PC_HOST_ADDRESS                        0x40
+#define DEFAULT_HOST_ADDRESS_BASE                   (DALY_PC_HOST_ADDRESS - 1)
+
+// BMS Data Structure
+typedef struct {
+    // Timestamps are kept as integers and only formatted when a row is written
+    long long cycleStartEpochUs;  // UTC microseconds since 1970-01-01 at the start of the cycle
+    long long cycleStartMonoUs;   // Monotonic microseconds at the start of the cycle
+    long long sampleMonoUs;       // Monotonic instant the row represents
+    // Monotonic time each command's request was sent, indexed by command - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC. 0 if no reply
+    long long commandMonoUs[G_NUMBER_OF_COMMANDS];
+    int batteryID;                // BMS address on the RS-485 bus
+    int numberOfBatteryCells;     // -1 until 0x94 has been read
+    int numberOfTempSensors;
+    float current;
+    float voltage;
+    float stateOfCharge;
+    float totalCapacity;
+    float remainingCapacity;
+    float cellVoltage[G_MAX_NUMBER_OF_CELLS];
+    float highestCellVoltage;
+    float lowestCellVoltage;
+    float temperatures[G_MAX_NUMBER_OF_TEMP_SENSORS];
+    int chargingDischargingStatus;
+    int chargingMOSStatus;
+    int dischargingMOSStatus;
+    int balancingStatus;
+    // cellBalancingStatus[i] is the balance status of cell i + 1
+    int cellBalancingStatus[G_MAX_NUMBER_OF_CELLS];
+    // Alarms' are stored in reverse bit order. I.e. alarms[i][0] is the alarm of the ith byte, last bit
+    char alarms[8][9];
+
+} BMSData;
+
+// Called on the polling thread as soon as a command's reply has been decoded into pData, and
+// with BMS_CYCLE_COMPLETE once every command of a cycle is in. pData is only valid for the
+// duration of the call
+typedef void (*BmsSampleCallback)(const BMSData *pData, int requestType, void *pUserData);
+
+// BMS Context Structure
+// Holds everything needed to talk to the packs on one serial bus. Use one context per bus
+typedef struct {
+    BmsPort hComm;
+    int maxBmsAddress;          // Discovery probes BMS addresses 1 to this
+    int hostAddressBase;        // Requests to BMS address n carry hostAddressBase + n in byte 1. Unverified, see above
+    int rediscoveryIntervalS;   // Addresses that didn't answer are probed again this often. 0 disables
+    long long lastDiscoveryMonoUs;
+    int alignSamples;           // 1 if current and voltage should be interpolated to the cell voltage instant
+    int verbose;                // 1 to print every frame and decoded value to stdout
+    BmsSampleCallback onSample;
+    void *pUserData;            // Passed back to onSample
+    // One entry per BMS found on the bus, in the order they are polled
+    BMSData packs[G_MAX_NUMBER_OF_PACKS];
+    int numberOfPacks;
+} DalyBmsContext;
+
+int initBmsContext(DalyBmsContext *ctx);
+int setBmsSampleCallback(DalyBmsContext *ctx, BmsSampleCallback onSample, void *pUserData);
+int closeBmsContext(DalyBmsContext *ctx);
+#ifdef _WIN32
+HANDLE setupCOMPort(DalyBmsContext *ctx, int portNumber);
+#endif
+BmsPort connectToCOMPort(DalyBmsContext *ctx, const char *portName);
+int closeBmsPort(BmsPort hComm);
+int purgeBmsPort(BmsPort hComm);
+int writeBmsPort(BmsPort hComm, const unsigned char *pData, int length);
+int readBmsPort(BmsPort hComm, unsigned char *pData, int length);
+int discoverBmsAddresses(DalyBmsContext *ctx);
+int rediscoverBmsAddresses(DalyBmsContext *ctx);
+int pollAllPacks(DalyBmsContext *ctx);
+long long getMonotonicUs();
+long long getEpochUs();
+long long monotonicToEpochUs(const BMSData *pData, long long monotonicUs);
+int alignCurrentVoltage(DalyBmsContext *ctx, BMSData *pData);
+int getBMSData(DalyBmsContext *ctx, BMSData *pData, int requestType);
+// Decoders. Each returns 1 once the reply has been decoded into pData, 0 if nothing could be
+int parseBmsResponseSoc(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseHighestLowestVoltage(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseMaxMinTemp(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseChargeDischargeMosStatus(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseStatusInfo1(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseSingleCellVoltage(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseSingleCellTemp(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseSingleCellBalancingStatus(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+int parseBmsResponseBatteryFailureStatus(DalyBmsContext *ctx, BMSData *pData, unsigned char *pResponse);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
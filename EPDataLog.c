@@ -1,25 +1,31 @@
-#include <windows.h>
+#include "DalyBms.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <stdarg.h>
+#include <math.h>
+#include <limits.h>
 
-#define READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC		    0x90
-#define READ_BAT_HIGHEST_LOWEST_VOLTAGE		        0x91
-#define READ_BAT_MAX_MIN_TEMP		                0x92
-#define READ_BAT_CHARGE_DISCHARGE_MOS_STATUS		0x93
-#define READ_BAT_STATUS_INFO_1		                0x94
-#define READ_BAT_SINGLE_CELL_VOLTAGE		        0x95
-#define READ_BAT_SINGLE_CELL_TEMP		            0x96
-#define READ_BAT_SINGLE_CELL_BALANCE_STATUS		    0x97 
-#define READ_BAT_SINGLE_CELL_FAILURE_STATUS		    0x98
-
-
-#define G_MAX_NUMBER_OF_CELLS                       16
-#define G_MAX_NUMBER_OF_TEMP_SENSORS                4
+#define CSV_LINE_MAX_LENGTH                         4096
+#define SEGMENT_SIZE_BYTES                          (4 * 1024 * 1024)   // Each journal segment is preallocated to this size
+#define JOURNAL_GROUP_BUFFER_SIZE                   (64 * 1024)
+#define BURST_RING_CAPACITY                         1024    // Pre-trigger samples kept in RAM
+#define BURST_FAILURE_POLL_DIVIDER                  8       // Poll 0x98 once every this many burst samples
 
 // Global Vars
-int g_number_of_battery_cells = -1;
-int g_number_of_temp_sensors = -1;
 int g_delay_time_ms = 2000;
+int g_max_bms_address = 1;  // Discovery probes BMS addresses 1 to this
+int g_host_address_base = DEFAULT_HOST_ADDRESS_BASE;  // Requests to BMS address n carry this + n
+int g_align_samples = 0;  // 1 if current and voltage should be interpolated to the cell voltage instant
+int g_commit_interval_ms = 1000;  // Longest time a record may sit in RAM before being flushed to disk
+int g_rotate_minutes = 60;        // Start a new segment after this many minutes. 0 disables time based rotation
+int g_trigger_enabled = 0;          // 1 to poll 0x90/0x95 at full rate between rows and capture events
+float g_trigger_current_a = 0;      // Trigger when |current| reaches this. 0 disables
+float g_trigger_cell_delta_mv = 0;  // Trigger when highest - lowest cell voltage reaches this. 0 disables
+int g_trigger_pre_ms = 5000;        // History written before the trigger
+int g_trigger_post_ms = 5000;       // Full rate capture after the trigger
+int g_line_numbers[G_MAX_NUMBER_OF_PACKS];  // Next CSV line number of each pack, indexed by BMS address - 1
 const int MIN_DELAY_TIME = 0;
 const int MAX_COM_PORT_NUMBER = 256;
 const int MIN_COM_PORT_NUMBER = 1;
@@ -28,52 +34,88 @@ const int INVALID_COM_PORT_NUMBER = -2;
 const int INVALID_DELAY_TIME_SUPPLIED = -3;
 const int NO_COM_PORT_NUMBER_SUPPLIED = -1;
 const int NO_DELAY_TIME_SUPPLIED = -1;
+const int INVALID_JOURNAL_OPTION_SUPPLIED = -4;
+const int INVALID_TRIGGER_OPTION_SUPPLIED = -5;
+const int INVALID_BMS_ADDRESS_SUPPLIED = -6;
 
 int readProgramParams(int argc, char *argv[]);
 int isInteger(char *str);
-HANDLE setupCOMPort(int portNumber);
-HANDLE connectToCOMPort(const char *portName);
-int getDateTime();
-int getBMSData(HANDLE hComm, int requestType);
-int parseBmsResponseSoc(unsigned char *pResponse);
-int parseBmsResponseHighestLowestVoltage(unsigned char *pResponse);
-int parseBmsResponseMaxMinTemp(unsigned char *pResponse);
-int parseBmsResponseChargeDischargeMosStatus(unsigned char *pResponse);
-int parseBmsResponseStatusInfo1(unsigned char *pResponse);
-int parseBmsResponseSingleCellVoltage(unsigned char *pResponse);
-int parseBmsResponseSingleCellTemp(unsigned char *pResponse);
-int parseBmsResponseSingleCellBalancingStatus(unsigned char *pResponse);
-int parseBmsResponseBatteryFailureStatus(unsigned char *pResponse);
-FILE *openCsvFile();
-int printCsvHeader(FILE *fp);
-int outputBMSDataToCsv(FILE *fp);
-
-// BMS Data Structure
+
+// One CSV line, built in memory so the journal can checksum it before writing
+typedef struct {
+    char text[CSV_LINE_MAX_LENGTH];
+    int length;
+} CsvLine;
+
+// Journal Structure
+// Records are written as "<sequence>,<CRC32 of payload>,<payload>\n" into segment files that are
+// preallocated to SEGMENT_SIZE_BYTES. The first line of a segment is the column header.
+typedef struct {
+    HANDLE hFile;
+    char fileName[40];
+    int segmentIndex;
+    long long writeOffset;          // End of the records written to the segment so far
+    long long segmentStartMonoUs;
+    long long lastCommitMonoUs;
+    unsigned long sequence;         // Sequence number of the last record appended
+    char group[JOURNAL_GROUP_BUFFER_SIZE];  // Records waiting for the next group commit
+    int groupLength;
+    CsvLine header;
+} Journal;
+
+int csvAppend(CsvLine *line, const char *format, ...);
+unsigned long crc32(const char *data, int length);
+int recoverJournalSegments();
+int recoverJournalSegment(const char *fileName);
+int openJournalSegment();
+int journalAppend(const CsvLine *line);
+int journalCommit();
+int journalCommitIfDue();
+long long journalCommitDeadline();
+int sleepUntil(long long wakeMonoUs);
+int sealJournalSegment();
+int printCsvHeader(CsvLine *line);
+int outputBMSDataToCsv(CsvLine *line, const BMSData *pData);
+
+// One fast 0x90/0x95 sample held in the pre-trigger ring
 typedef struct {
-    int lineNumber;
-    char dateTime[20];  // Enough to hold "YYYY-MM-DD HH:MM:SS" and '\0'
-    int batteryID;
+    long long monoUs;
     float current;
     float voltage;
-    float stateOfCharge;
-    float totalCapacity;
-    float remainingCapacity;
     float cellVoltage[G_MAX_NUMBER_OF_CELLS];
-    float highestCellVoltage;
-    float lowestCellVoltage;
-    float temperatures[G_MAX_NUMBER_OF_TEMP_SENSORS];
-    int chargingDischargingStatus;
-    int chargingMOSStatus;
-    int dischargingMOSStatus;
-    int balancingStatus;
-    // Balance Status' are stored in reverse order. I.e. balance_status[0] is the balance status of the last cell
-    int cellBalancingStatus[G_MAX_NUMBER_OF_CELLS];
-    // Alarms' are stored in reverse bit order. I.e. alarms[i][0] is the alarm of the ith byte, last bit
-    char alarms[8][9];
+} BurstSample;
 
-} BMSData;
-
-BMSData bmsData; // Declare a BMSData struct variable
+// Burst Capture Structure
+typedef struct {
+    BurstSample ring[BURST_RING_CAPACITY];
+    int head;                   // Index the next sample is written to
+    int count;
+    int armed;                  // Cleared after an event until the trigger condition goes away
+    HANDLE hEventFile;          // INVALID_HANDLE_VALUE when no event is being captured
+    char eventFileName[40];
+    long long triggerMonoUs;
+    long long lastFlushMonoUs;
+    int nSamplesPolled;
+} BurstCapture;
+
+int burstPollUntil(DalyBmsContext *ctx, long long deadlineMonoUs);
+int burstSamplePack(DalyBmsContext *ctx, BMSData *pData, BurstCapture *pBurst);
+const char *checkBurstTrigger(const BMSData *pData);
+int openEventFile(const BMSData *pData, BurstCapture *pBurst, const char *reason);
+int writeBurstSample(const BMSData *pData, BurstCapture *pBurst, const BurstSample *sample);
+int closeEventFile(BurstCapture *pBurst);
+int readFloatOption(int argc, char *argv[], int *i, float *value);
+int readIntOption(int argc, char *argv[], int *i, int *value);
+int formatTimestamp(long long epochUs, char *buffer, size_t bufferSize);
+void onBmsSample(const BMSData *pData, int requestType, void *pUserData);
+BOOL WINAPI onConsoleCtrl(DWORD ctrlType);
+
+
+Journal journal;
+BurstCapture bursts[G_MAX_NUMBER_OF_PACKS];
+// Held while the journal or an event file is written. The console control handler runs on its own
+// thread and takes it before sealing, so it never closes a file in the middle of a write
+CRITICAL_SECTION g_file_lock;
 
 
 // Returns the supplied COM port number, or -1 if none was supplied
@@ -121,6 +163,57 @@ int readProgramParams(int argc, char *argv[]) {
             } else {
                 printf("Error: Missing value for -t option\n");
             }
+    // Enable interpolation of current and voltage to a common instant
+        } else if (strcmp(argv[i], "-a") == 0) {
+            g_align_samples = 1;
+            printf("Success: Current and voltage will be aligned to the cell voltage sample\n");
+    // Try to read the journal commit window from the command line
+        } else if (strcmp(argv[i], "-w") == 0) {
+            if (i + 1 >= argc || !isInteger(argv[i + 1]) || atoi(argv[i + 1]) < 0) {
+                printf("Error: Invalid value for -w option. Aborting\n");
+                return INVALID_JOURNAL_OPTION_SUPPLIED;
+            }
+            g_commit_interval_ms = atoi(argv[++i]);
+            printf("Success: Commit window of %dms set\n", g_commit_interval_ms);
+    // Try to read the segment rotation time from the command line
+        } else if (strcmp(argv[i], "-r") == 0) {
+            if (i + 1 >= argc || !isInteger(argv[i + 1]) || atoi(argv[i + 1]) < 0) {
+                printf("Error: Invalid value for -r option. Aborting\n");
+                return INVALID_JOURNAL_OPTION_SUPPLIED;
+            }
+            g_rotate_minutes = atoi(argv[++i]);
+            printf("Success: Segment rotation time of %d minutes set\n", g_rotate_minutes);
+    // Try to read the highest BMS address to look for from the command line
+        } else if (strcmp(argv[i], "-n") == 0) {
+            if (!readIntOption(argc, argv, &i, &g_max_bms_address) ||
+                g_max_bms_address < 1 || g_max_bms_address > G_MAX_NUMBER_OF_PACKS) {
+                printf("Error: BMS address must be between 1 and %d. Aborting\n", G_MAX_NUMBER_OF_PACKS);
+                return INVALID_BMS_ADDRESS_SUPPLIED;
+            }
+            printf("Success: Searching BMS addresses 1 to %d\n", g_max_bms_address);
+        } else if (strcmp(argv[i], "-ha") == 0) {
+            if (!readIntOption(argc, argv, &i, &g_host_address_base) ||
+                g_host_address_base + G_MAX_NUMBER_OF_PACKS > 0xFF) {
+                printf("Error: Host address base must be between 0 and %d. Aborting\n", 0xFF - G_MAX_NUMBER_OF_PACKS);
+                return INVALID_BMS_ADDRESS_SUPPLIED;
+            }
+            printf("Success: Requests to BMS address n are sent as host address %d + n\n", g_host_address_base);
+    // Event trigger options
+        } else if (strcmp(argv[i], "-e") == 0) {
+            g_trigger_enabled = 1;
+            printf("Success: Event trigger capture enabled\n");
+        } else if (strcmp(argv[i], "-ei") == 0) {
+            if (!readFloatOption(argc, argv, &i, &g_trigger_current_a)) return INVALID_TRIGGER_OPTION_SUPPLIED;
+            printf("Success: Current trigger of %.1fA set\n", g_trigger_current_a);
+        } else if (strcmp(argv[i], "-ed") == 0) {
+            if (!readFloatOption(argc, argv, &i, &g_trigger_cell_delta_mv)) return INVALID_TRIGGER_OPTION_SUPPLIED;
+            printf("Success: Cell delta trigger of %.0fmV set\n", g_trigger_cell_delta_mv);
+        } else if (strcmp(argv[i], "-eb") == 0) {
+            if (!readIntOption(argc, argv, &i, &g_trigger_pre_ms)) return INVALID_TRIGGER_OPTION_SUPPLIED;
+            printf("Success: Pre-trigger window of %dms set\n", g_trigger_pre_ms);
+        } else if (strcmp(argv[i], "-ea") == 0) {
+            if (!readIntOption(argc, argv, &i, &g_trigger_post_ms)) return INVALID_TRIGGER_OPTION_SUPPLIED;
+            printf("Success: Post-trigger window of %dms set\n", g_trigger_post_ms);
         }
     }
 
@@ -144,143 +237,197 @@ int isInteger(char *str) {
     return 1;
 }
 
-HANDLE setupCOMPort(int portNumber) {
-    if (portNumber != -1) {
-        char comPortName[10];  // Enough space for "COM" + up to 3 digits + null terminator
-        sprintf(comPortName, "COM%d", portNumber);  // Format the COM port name
-        printf("Attempting to use COM port %d\n", portNumber);
-        HANDLE hComm = connectToCOMPort(comPortName);
-        Sleep(500);
-        if (hComm != INVALID_HANDLE_VALUE) {
-            // Use REQUEST_TOTAL_VOLTAGE_CURRENT_SOC as queryData
-            const unsigned char queryData[13] = {0XA5, 0X40, 0X90, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x7D};
-            DWORD bytesWritten;
-
-            // Send a query
-            if (!WriteFile(hComm, queryData, sizeof(queryData), &bytesWritten, NULL)) {
-                printf("Error in writing to COM port. Aborting.\n");
-                CloseHandle(hComm);
-                return INVALID_HANDLE_VALUE;
-            }
-
-            unsigned char buffer[300];
-            DWORD bytesRead;
+// Reads the non-negative value following argv[*i], advancing *i past it
+int readFloatOption(int argc, char *argv[], int *i, float *value) {
+    char *endptr;
+    if (*i + 1 >= argc) {
+        printf("Error: Missing value for %s option. Aborting\n", argv[*i]);
+        return 0;
+    }
+    float parsed = strtof(argv[*i + 1], &endptr);
+    if (endptr == argv[*i + 1] || *endptr != '\0' || parsed < 0) {
+        printf("Error: Invalid value for %s option. Aborting\n", argv[*i]);
+        return 0;
+    }
+    *value = parsed;
+    (*i)++;
+    return 1;
+}
 
-            // Read the response
-            if (!ReadFile(hComm, buffer, sizeof(buffer), &bytesRead, NULL)) {
-                printf("Error in reading from COM port. Aborting.\n");
-                CloseHandle(hComm);
-                return INVALID_HANDLE_VALUE;
-            }
+int readIntOption(int argc, char *argv[], int *i, int *value) {
+    if (*i + 1 >= argc || !isInteger(argv[*i + 1]) || atoi(argv[*i + 1]) < 0) {
+        printf("Error: Invalid value for %s option. Aborting\n", argv[*i]);
+        return 0;
+    }
+    *value = atoi(argv[++(*i)]);
+    return 1;
+}
 
-            // Check the response
-            if (buffer[0] == 0xA5 && buffer[1] == 0x01 && buffer[2] == 0x90) {
-                printf("Found the target COM port: %s\n", comPortName);
-                return hComm;
-            }
+// Formats a UTC epoch in microseconds as local time "YYYY-MM-DD HH:MM:SS.uuuuuu".
+// The "YYYY-MM-DD HH:" prefix is cached, so localtime only runs once per hour.
+int formatTimestamp(long long epochUs, char *buffer, size_t bufferSize) {
+    static long long cachedHourStart = -1;  // epoch seconds at the start of the cached hour
+    static char cachedPrefix[16];           // Enough to hold "YYYY-MM-DD HH:" and '\0'
+
+    long long epochSeconds = epochUs / 1000000;
+    int microseconds = (int)(epochUs % 1000000);
+
+    if (cachedHourStart < 0 || epochSeconds < cachedHourStart || epochSeconds >= cachedHourStart + 3600) {
+        time_t raw_time = (time_t)epochSeconds;
+        struct tm *tm_info = localtime(&raw_time);
+
+        snprintf(cachedPrefix, sizeof(cachedPrefix), "%04d-%02d-%02d %02d:",
+                 tm_info->tm_year + 1900,
+                 tm_info->tm_mon + 1,
+                 tm_info->tm_mday,
+                 tm_info->tm_hour);
+        cachedHourStart = epochSeconds - tm_info->tm_min * 60 - tm_info->tm_sec;
+    }
 
-            // Close the handle if this isn't the correct one
-            CloseHandle(hComm);
-        } else {
-            printf("Error: Unable to open COM port %s. Aborting.\n", comPortName);
-            return INVALID_HANDLE_VALUE;
-        }
-    } else {
-        printf("No COM port supplied. Searching for a COM port... \n");
-        for (int i = 1; i <= 256; ++i) {
-            char comPortName[10];  // Enough space for "COM" + up to 3 digits + null terminator
-            sprintf(comPortName, "COM%d", i);  // Format the COM port name
-            HANDLE hComm = connectToCOMPort(comPortName);
-            Sleep(500);
-            if (hComm != INVALID_HANDLE_VALUE) {
-                // Use REQUEST_TOTAL_VOLTAGE_CURRENT_SOC as queryData
-                const unsigned char queryData[13] = {0XA5, 0X40, 0X90, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x7D};
-                DWORD bytesWritten;
-
-                // Send a query
-                if (!WriteFile(hComm, queryData, sizeof(queryData), &bytesWritten, NULL)) {
-                    printf("Error in writing to COM port\n");
-                    CloseHandle(hComm);
-                    continue;
-                }
+    int secondsIntoHour = (int)(epochSeconds - cachedHourStart);
+    snprintf(buffer, bufferSize, "%s%02d:%02d.%06d",
+             cachedPrefix,
+             secondsIntoHour / 60,
+             secondsIntoHour % 60,
+             microseconds);
+    return 0;
+}
 
-                unsigned char buffer[300];
-                DWORD bytesRead;
+int csvAppend(CsvLine *line, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(line->text + line->length, sizeof(line->text) - line->length, format, args);
+    va_end(args);
 
-                // Read the response
-                if (!ReadFile(hComm, buffer, sizeof(buffer), &bytesRead, NULL)) {
-                    printf("Error in reading from COM port\n");
-                    CloseHandle(hComm);
-                    continue;
-                }
+    if (written < 0 || line->length + written >= (int)sizeof(line->text)) {
+        printf("CSV line too long, truncated\n");
+        line->length = sizeof(line->text) - 1;
+        return 0;
+    }
+    line->length += written;
+    return written;
+}
 
-                // Check the response
-                if (buffer[0] == 0xA5 && buffer[1] == 0x01 && buffer[2] == 0x90) {
-                    printf("Found the target COM port: %s\n", comPortName);
-                    return hComm;
-                }
+// Standard CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320)
+unsigned long crc32(const char *data, int length) {
+    unsigned long crc = 0xFFFFFFFF;
 
-                // Close the handle if this isn't the correct one
-                CloseHandle(hComm);
-            } else {
-                printf("Unable to open COM port %s\n", comPortName);
-            }
+    for (int i = 0; i < length; i++) {
+        crc ^= (unsigned char)data[i];
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
         }
-    
     }
+    return ~crc & 0xFFFFFFFF;
 }
 
-HANDLE connectToCOMPort(const char *portName) {
-    printf("Trying port %s\n", portName);
-    DCB dcbSerialParams = {0};
-    COMMTIMEOUTS timeouts = {0};
-    
-    HANDLE hComm = CreateFile(portName,
-                              GENERIC_READ | GENERIC_WRITE,
-                              0,
-                              NULL,
-                              OPEN_EXISTING,
-                              0,
-                              NULL);
+// Runs at startup. Any segment left open by a power cut still has its preallocated tail, and may
+// end in a torn record. Each such segment is cut back to the end of its last valid record.
+// Sealing trims the tail, so a file of any other size was sealed (or edited since) and is left alone.
+int recoverJournalSegments() {
+    WIN32_FIND_DATA findData;
+    HANDLE hFind = FindFirstFile("EPData*.csv", &findData);
 
-    if (hComm == INVALID_HANDLE_VALUE) {
-        return INVALID_HANDLE_VALUE;
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return 0;
     }
 
-    dcbSerialParams.DCBlength = sizeof(DCB);
+    do {
+        if (findData.nFileSizeHigh == 0 && findData.nFileSizeLow == SEGMENT_SIZE_BYTES) {
+            recoverJournalSegment(findData.cFileName);
+        }
+    } while (FindNextFile(hFind, &findData));
+
+    FindClose(hFind);
+    return 0;
+}
+
+int recoverJournalSegment(const char *fileName) {
+    const char *HEADER_PREFIX = "Seq, CRC32, ";
 
-    if (!GetCommState(hComm, &dcbSerialParams)) {
-        printf("Error getting current DCB settings\n");
-        CloseHandle(hComm);
-        return INVALID_HANDLE_VALUE;
+    HANDLE hFile = CreateFile(fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        printf("Recovery: could not open %s\n", fileName);
+        return 0;
     }
 
-    dcbSerialParams.BaudRate = CBR_9600;
-    dcbSerialParams.ByteSize = 8;
-    dcbSerialParams.StopBits = ONESTOPBIT;
-    dcbSerialParams.Parity   = NOPARITY;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart != SEGMENT_SIZE_BYTES) {
+        CloseHandle(hFile);  // Not an unsealed segment
+        return 0;
+    }
 
-    if (!SetCommState(hComm, &dcbSerialParams)) {
-        printf("Could not set serial port parameters\n");
-        CloseHandle(hComm);
-        return INVALID_HANDLE_VALUE;
+    char *contents = malloc((size_t)fileSize.QuadPart);
+    DWORD bytesRead;
+    if (contents == NULL || !ReadFile(hFile, contents, (DWORD)fileSize.QuadPart, &bytesRead, NULL)) {
+        printf("Recovery: could not read %s\n", fileName);
+        free(contents);
+        CloseHandle(hFile);
+        return 0;
     }
 
-    timeouts.ReadIntervalTimeout         = 50;
-    timeouts.ReadTotalTimeoutConstant    = 50;
-    timeouts.ReadTotalTimeoutMultiplier  = 10;
-    timeouts.WriteTotalTimeoutConstant   = 50;
-    timeouts.WriteTotalTimeoutMultiplier = 10;
+    long long validEnd = 0;
+    int nRecords = 0;
+    char *headerEnd = memchr(contents, '\n', bytesRead);
+
+    if (headerEnd != NULL && strncmp(contents, HEADER_PREFIX, strlen(HEADER_PREFIX)) == 0) {
+        validEnd = headerEnd - contents + 1;
+        unsigned long expectedSequence = 0;
+
+        // Walk the records until one is torn, fails its CRC or is out of sequence
+        while (validEnd < (long long)bytesRead) {
+            char *record = contents + validEnd;
+            char *recordEnd = memchr(record, '\n', bytesRead - validEnd);
+            if (recordEnd == NULL) {
+                break;
+            }
+
+            char *endptr;
+            unsigned long sequence = strtoul(record, &endptr, 10);
+            if (endptr == record || *endptr != ',' || (nRecords > 0 && sequence != expectedSequence)) {
+                break;
+            }
+
+            char *crcText = endptr + 1;
+            unsigned long storedCrc = strtoul(crcText, &endptr, 16);
+            if (endptr != crcText + 8 || *endptr != ',') {
+                break;
+            }
+
+            char *payload = endptr + 1;
+            if (crc32(payload, (int)(recordEnd - payload)) != storedCrc) {
+                break;
+            }
+
+            expectedSequence = sequence + 1;
+            nRecords++;
+            validEnd = recordEnd - contents + 1;
+        }
+    } else if (contents[0] != '\0') {
+        // Not a journal segment, e.g. a CSV from an older version. Leave it alone
+        free(contents);
+        CloseHandle(hFile);
+        return 0;
+    }
 
-    if (!SetCommTimeouts(hComm, &timeouts)) {
-        printf("Could not set serial port timeouts\n");
-        CloseHandle(hComm);
-        return INVALID_HANDLE_VALUE;
+    if (validEnd < fileSize.QuadPart) {
+        LARGE_INTEGER newEnd;
+        newEnd.QuadPart = validEnd;
+        if (SetFilePointerEx(hFile, newEnd, NULL, FILE_BEGIN) && SetEndOfFile(hFile)) {
+            FlushFileBuffers(hFile);
+            printf("Recovery: %s kept %d records, truncated %lld bytes\n",
+                   fileName, nRecords, fileSize.QuadPart - validEnd);
+        } else {
+            printf("Recovery: could not truncate %s\n", fileName);
+        }
     }
-    return hComm;
+
+    free(contents);
+    CloseHandle(hFile);
+    return nRecords;
 }
 
-int getDateTime() {
+int openJournalSegment() {
     // Get current date and time
     time_t raw_time;
     struct tm *tm_info;
@@ -288,511 +435,544 @@ int getDateTime() {
     time(&raw_time);
     tm_info = localtime(&raw_time);
 
-    // Store date and time in BMSData struct
-    snprintf(bmsData.dateTime, sizeof(bmsData.dateTime), "%04d-%02d-%02d %02d:%02d:%02d", 
-             tm_info->tm_year + 1900, 
+    char dateTime[14];
+    // Store date and time in dateTime array
+    snprintf(dateTime, sizeof(dateTime), "%02d%02d%02d_%02d%02d%02d", 
+             (tm_info->tm_year + 1900) % 100, 
              tm_info->tm_mon + 1, 
              tm_info->tm_mday, 
              tm_info->tm_hour, 
              tm_info->tm_min, 
              tm_info->tm_sec);
 
-    printf("\n\nCurrent Time: %s\n", bmsData.dateTime);
+    journal.segmentIndex++;
+    snprintf(journal.fileName, sizeof(journal.fileName), "EPData%s_%03d.csv", dateTime, journal.segmentIndex);
 
-}
+    journal.hFile = CreateFile(journal.fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 
+    if (journal.hFile == INVALID_HANDLE_VALUE) {
+        printf("Could not open file for writing.\n");
+        return 0;
+    }
 
-int getBMSData(HANDLE hComm, int requestType) {
-    const int REQ_LEN = 13;
-    const unsigned char REQUEST_TOTAL_VOLTAGE_CURRENT_SOC[13] = {0XA5, 0X40, 0X90, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x7D};
-    const unsigned char REQUEST_HIGHEST_LOWEST_VOLTAGE[13] = {0XA5, 0X40, 0X91, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x7E};
-    const unsigned char REQUEST_MAX_MIN_TEMP[13] = {0XA5, 0X40, 0X92, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x7F};
-    const unsigned char REQUEST_CHARGE_DISCHARGE_MOS_STATUS[13] = {0XA5, 0X40, 0X93, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x80};
-    const unsigned char REQUEST_STATUS_INFO_1[13] = {0XA5, 0X40, 0X94, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x81};
-    const unsigned char REQUEST_SINGLE_CELL_VOLTAGE[13] = {0XA5, 0X40, 0X95, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x82};
-    const unsigned char REQUEST_SINGLE_CELL_TEMP[13] = {0XA5, 0X40, 0X96, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x83};
-    const unsigned char REQUEST_SINGLE_CELL_BALANCE_STATUS[13] = {0XA5, 0X40, 0X97, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x84};
-    const unsigned char REQUEST_SINGLE_CELL_FAILURE_STATUS[13] = {0XA5, 0X40, 0X98, 0X08, 0X00, 0X00, 0x00, 0x00, 0X00, 0X00, 0X00, 0X00, 0x85};
-
-    const unsigned char *pRequest;
-    unsigned char pResponse[300];
-
-    switch( requestType ) { 
-        case READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC:
-            pRequest = REQUEST_TOTAL_VOLTAGE_CURRENT_SOC;
-            break;
-        case READ_BAT_HIGHEST_LOWEST_VOLTAGE:
-            pRequest = REQUEST_HIGHEST_LOWEST_VOLTAGE;
-            break;
-        case READ_BAT_MAX_MIN_TEMP:
-            pRequest = REQUEST_MAX_MIN_TEMP;
-            break;
-        case READ_BAT_CHARGE_DISCHARGE_MOS_STATUS:
-            pRequest = REQUEST_CHARGE_DISCHARGE_MOS_STATUS;
-            break;
-        case READ_BAT_STATUS_INFO_1:
-            pRequest = REQUEST_STATUS_INFO_1;
-            break;
-        case READ_BAT_SINGLE_CELL_VOLTAGE:
-            pRequest = REQUEST_SINGLE_CELL_VOLTAGE;
-            break;
-        case READ_BAT_SINGLE_CELL_TEMP:
-            pRequest = REQUEST_SINGLE_CELL_TEMP;
-            break;
-        case READ_BAT_SINGLE_CELL_BALANCE_STATUS:
-            pRequest = REQUEST_SINGLE_CELL_BALANCE_STATUS;
-            break;
-        case READ_BAT_SINGLE_CELL_FAILURE_STATUS:
-            pRequest = REQUEST_SINGLE_CELL_FAILURE_STATUS;
-            break;
-        default:
-            return 0;
+    // Preallocate the whole segment so appends never have to grow the file
+    LARGE_INTEGER offset;
+    offset.QuadPart = SEGMENT_SIZE_BYTES;
+    if (!SetFilePointerEx(journal.hFile, offset, NULL, FILE_BEGIN) || !SetEndOfFile(journal.hFile)) {
+        printf("Could not preallocate %s\n", journal.fileName);
     }
+    offset.QuadPart = 0;
+    SetFilePointerEx(journal.hFile, offset, NULL, FILE_BEGIN);
 
-    const int MAX_RETRY = 1;
-    DWORD bytesWritten;
+    journal.writeOffset = 0;
+    journal.segmentStartMonoUs = getMonotonicUs();
 
-    for (int i = 0; i < MAX_RETRY; i++) {
-        
-        BOOL status = WriteFile(hComm, pRequest, REQ_LEN, &bytesWritten, NULL);
+    journal.groupLength = snprintf(journal.group, sizeof(journal.group), "Seq, CRC32, %s\n", journal.header.text);
+    journalCommit();
 
-        if (status) {
-            printf("Data written to port, %lu bytes\n", bytesWritten);
-        } else {
-            printf("Could not write data to port\n");
+    printf("Writing to %s\n", journal.fileName);
+    return 1;
+}
+
+// Queues one record for the next group commit. Records are committed once g_commit_interval_ms
+// has passed since the last commit, which bounds how much data a power cut can lose.
+int journalAppend(const CsvLine *line) {
+    char record[CSV_LINE_MAX_LENGTH + 32];
+    int recordLength = snprintf(record, sizeof(record), "%lu,%08lX,%s\n",
+                                journal.sequence + 1, crc32(line->text, line->length), line->text);
+
+    long long now = getMonotonicUs();
+    int segmentFull = journal.writeOffset + journal.groupLength + recordLength > SEGMENT_SIZE_BYTES;
+    int segmentExpired = g_rotate_minutes > 0 &&
+                         now - journal.segmentStartMonoUs >= (long long)g_rotate_minutes * 60 * 1000000;
+
+    if (segmentFull || segmentExpired) {
+        sealJournalSegment();
+        if (!openJournalSegment()) {
+            return 0;
         }
+    }
 
+    if (journal.groupLength + recordLength > (int)sizeof(journal.group)) {
+        journalCommit();
+    }
 
-        DWORD bytesRead;
-        status = ReadFile(hComm, pResponse, sizeof(pResponse), &bytesRead, NULL);
+    memcpy(journal.group + journal.groupLength, record, recordLength);
+    journal.groupLength += recordLength;
+    journal.sequence++;
 
-        if (status) {
-            printf("Data read from port: ");
-            for (int i = 0; i < bytesRead; i++) {
-                printf("%02X ", pResponse[i]);
-            }
-            printf("\n");
-        } else {
-            printf("Could not read data from port\n");
-        }
+    if (now - journal.lastCommitMonoUs >= (long long)g_commit_interval_ms * 1000) {
+        journalCommit();
+    }
+    return 1;
+}
 
-        switch( pResponse[2] ) {
-            case READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC:
-                parseBmsResponseSoc(pResponse);
-                break;
-            case READ_BAT_HIGHEST_LOWEST_VOLTAGE:
-                parseBmsResponseHighestLowestVoltage(pResponse);
-                break;
-            case READ_BAT_MAX_MIN_TEMP:
-                parseBmsResponseMaxMinTemp(pResponse);
-                break;
-            case READ_BAT_CHARGE_DISCHARGE_MOS_STATUS:
-                parseBmsResponseChargeDischargeMosStatus(pResponse);
-                break;
-            case READ_BAT_STATUS_INFO_1:
-                parseBmsResponseStatusInfo1(pResponse);
-                break;
-            case READ_BAT_SINGLE_CELL_VOLTAGE:
-                parseBmsResponseSingleCellVoltage(pResponse);
-                break;
-            case READ_BAT_SINGLE_CELL_TEMP:
-                parseBmsResponseSingleCellTemp(pResponse);
-                break;
-            case READ_BAT_SINGLE_CELL_BALANCE_STATUS:
-                parseBmsResponseSingleCellBalancingStatus(pResponse);
-                break;
-            case READ_BAT_SINGLE_CELL_FAILURE_STATUS:
-                parseBmsResponseBatteryFailureStatus(pResponse);
-                break;
-            default:
-                return 0;
-            }
+int journalCommit() {
+    if (journal.groupLength == 0) {
+        return 1;
     }
 
-}
+    DWORD bytesWritten;
+    if (!WriteFile(journal.hFile, journal.group, journal.groupLength, &bytesWritten, NULL) ||
+        !FlushFileBuffers(journal.hFile)) {
+        printf("Could not commit to %s\n", journal.fileName);
+        return 0;
+    }
 
-int parseBmsResponseSoc(unsigned char *pResponse) {
-    // Data bits start at index 4
-    float cumulative_total_voltage = ((pResponse[4] << 8) + pResponse[5]) * 0.1f;
-    float collect_total_voltage = ((pResponse[6] << 8) + pResponse[7]) * 0.1f;
-    float current = (((pResponse[8] << 8) + pResponse[9]) - 30000) * 0.1f;
-    float soc = ((pResponse[10] << 8) + pResponse[11]) * 0.1f;
-
-    bmsData.voltage = cumulative_total_voltage;
-    bmsData.current = current;
-    bmsData.stateOfCharge = soc;
-
-    printf("cumulative_total_voltage: %.2fV\n", cumulative_total_voltage);
-    printf("collect_total_voltage: %.2fV\n", collect_total_voltage);
-    printf("current: %.2fA\n", current);
-    printf("soc: %.2f%%\n", soc);
+    journal.writeOffset += bytesWritten;
+    journal.groupLength = 0;
+    journal.lastCommitMonoUs = getMonotonicUs();
+    return 1;
 }
 
-int parseBmsResponseHighestLowestVoltage(unsigned char *pResponse) {
-    // Data bits start at index 4
-    float highest_single_voltage = (pResponse[4] << 8) + pResponse[5];
-    int highest_voltage_cell_number = pResponse[6];
-    float lowest_single_voltage = (pResponse[7] << 8) + pResponse[8];
-    int lowest_voltage_cell_number = pResponse[9];
-
-    bmsData.highestCellVoltage = highest_single_voltage;
-    bmsData.lowestCellVoltage = lowest_single_voltage;
+// Commits the pending records once they have waited g_commit_interval_ms. journalAppend only runs
+// when a row arrives, so the polling loop calls this between rows to keep the loss window bounded
+// when several packs' rows land at once or the log interval is longer than the commit window
+int journalCommitIfDue() {
+    int result = 1;
 
-    printf("highest_single_voltage: %.2fmV\n", highest_single_voltage);
-    printf("highest_voltage_cell_number: %d\n", highest_voltage_cell_number);
-    printf("lowest_single_voltage: %.2fmV\n", lowest_single_voltage);
-    printf("lowest_voltage_cell_number: %d\n", lowest_voltage_cell_number);
+    EnterCriticalSection(&g_file_lock);
+    if (journal.groupLength > 0 && getMonotonicUs() >= journalCommitDeadline()) {
+        result = journalCommit();
+    }
+    LeaveCriticalSection(&g_file_lock);
+    return result;
 }
 
-int parseBmsResponseMaxMinTemp(unsigned char *pResponse) {
-    // Data bits start at index 4
-    float max_temp = pResponse[4] - 40;
-    int max_temp_cell_number = pResponse[5];
-    float min_temp = pResponse[6] - 40;
-    int min_temp_cell_number = pResponse[7];
-
-    printf("max_temp: %.2fC\n", max_temp);
-    printf("max_temp_cell_number: %d\n", max_temp_cell_number);
-    printf("min_temp: %.2fC\n", min_temp);
-    printf("min_temp_cell_number: %d\n", min_temp_cell_number);
+// Monotonic time the pending records must be committed by, or LLONG_MAX if nothing is pending
+long long journalCommitDeadline() {
+    if (journal.groupLength == 0) {
+        return LLONG_MAX;
+    }
+    return journal.lastCommitMonoUs + (long long)g_commit_interval_ms * 1000;
 }
 
-int parseBmsResponseChargeDischargeMosStatus(unsigned char *pResponse) {
-    // Data bits start at index 4
-    int charge_discharge_status = pResponse[4];
-    int mos_tube_charging_status = pResponse[5];
-    int mos_tube_discharging_status = pResponse[6];
-    int bms_life = pResponse[7];
-    int remaining_capacity = (pResponse[8] << 24) | (pResponse[9] << 16) | (pResponse[10] << 8) | pResponse[11];
-
-    bmsData.chargingDischargingStatus = charge_discharge_status;
-    bmsData.chargingMOSStatus = mos_tube_charging_status;
-    bmsData.dischargingMOSStatus = mos_tube_discharging_status;
-
-    bmsData.remainingCapacity = remaining_capacity;
-
-    printf("charge_discharge_status: %d\n", charge_discharge_status);
-    printf("mos_tube_charging_status: %d\n", mos_tube_charging_status);
-    printf("mos_tube_discharging_status: %d\n", mos_tube_discharging_status);
-    printf("bms_life: %d\n", bms_life);
-    printf("remaining_capacity: %dmAH\n", remaining_capacity);
+// Sleeps until wakeMonoUs, waking early to commit the journal whenever its commit window runs out
+int sleepUntil(long long wakeMonoUs) {
+    long long now;
+    while ((now = getMonotonicUs()) < wakeMonoUs) {
+        long long until = journalCommitDeadline();
+        if (until > wakeMonoUs) {
+            until = wakeMonoUs;
+        }
+        if (until > now) {
+            Sleep((DWORD)((until - now + 999) / 1000));
+        }
+        journalCommitIfDue();
+    }
+    return 0;
 }
 
-int parseBmsResponseStatusInfo1(unsigned char *pResponse) {
-    // Data bits start at index 4
-    int battery_strings = pResponse[4];
-    int number_of_temperature = pResponse[5];
-    int charger_status = pResponse[6];
-    int load_status = pResponse[7];
-    int states = pResponse[8];
-
-    int DI1_state = (states >> 0) & 1;
-    int DI2_state = (states >> 1) & 1;
-    int DI3_state = (states >> 2) & 1;
-    int DI4_state = (states >> 3) & 1;
-    int DO1_state = (states >> 4) & 1;
-    int DO2_state = (states >> 5) & 1;
-    int DO3_state = (states >> 6) & 1;
-    int DO4_state = (states >> 7) & 1;
-
-    g_number_of_battery_cells = battery_strings;
-    g_number_of_temp_sensors = number_of_temperature;
-
-    printf("battery_strings: %d\n", battery_strings);
-    printf("number_of_temperature: %d\n", number_of_temperature);
-    printf("charger_status: %d\n", charger_status);
-    printf("load_status: %d\n", load_status);
-    printf("DI1_state: %d\n", DI1_state);
-    printf("DI2_state: %d\n", DI2_state);
-    printf("DI3_state: %d\n", DI3_state);
-    printf("DI4_state: %d\n", DI4_state);
-    printf("DO1_state: %d\n", DO1_state);
-    printf("DO2_state: %d\n", DO2_state);
-    printf("DO3_state: %d\n", DO3_state);
-    printf("DO4_state: %d\n", DO4_state);
+// Commits any pending records and trims the unused preallocated space, leaving a plain CSV file
+int sealJournalSegment() {
+    journalCommit();
+
+    LARGE_INTEGER offset;
+    offset.QuadPart = journal.writeOffset;
+    SetFilePointerEx(journal.hFile, offset, NULL, FILE_BEGIN);
+    SetEndOfFile(journal.hFile);
+    FlushFileBuffers(journal.hFile);
+    CloseHandle(journal.hFile);
+    journal.hFile = INVALID_HANDLE_VALUE;
+    return 1;
 }
 
-int parseBmsResponseSingleCellVoltage(unsigned char *pResponse) {
-    // Data bits start at index 4
+int printCsvHeader(CsvLine *line) {
+    csvAppend(line, "Line #, Timestamp, Battery ID, Current (A), Voltage (V), State Of Charge (%%), Total Capacity, Remaining Capacity (mAH),");
+    
+    // Print cell voltage headers
+    for (int i = 1; i <= G_MAX_NUMBER_OF_CELLS; ++i) {
+        csvAppend(line, "Cell Voltage %d (mV),", i);
+    }
+    
+    csvAppend(line, "Highest Cell Voltage (mV), Lowest Cell Voltage (mV),");
+    
+    // Print temperature headers
+    for (int i = 1; i <= G_MAX_NUMBER_OF_TEMP_SENSORS; ++i) {
+        csvAppend(line, "Temperature %d (C),", i);
+    }
+    
+    csvAppend(line, "Charging (1) Discharging (2) Status, Charging MOS Status, Discharging MOS Status, Balancing Status, Cell Balancing Status,");
+
+    // Print alarm headers
+    for (int i = 1; i <= 8; ++i) {
+        csvAppend(line, "Alarm %d,", i);
+    }
 
-    float cell_voltages[G_MAX_NUMBER_OF_CELLS];
+    csvAppend(line, "Epoch (us),");
 
-    const int MESSAGE_LENGTH = 13;
-    const int MAX_FRAMES = 16;
-    const int CELLS_PER_FRAME = 3;
+    // Print per-command request time headers
+    for (int i = 0; i < G_NUMBER_OF_COMMANDS; ++i) {
+        csvAppend(line, "0x%02X Request Offset (us),", READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC + i);
+    }
 
-    int nCellsRead = 0; // number of battery cells read
-    int readIndex = 4;
+    return 0;
+}
 
-    for (int i = 0; i < MAX_FRAMES; i++) {
-        if (nCellsRead == g_number_of_battery_cells) {
-            break;
-        }
+int outputBMSDataToCsv(CsvLine *line, const BMSData *pData) {
+    long long sampleEpochUs = monotonicToEpochUs(pData, pData->sampleMonoUs);
+    char dateTime[32];
+    formatTimestamp(sampleEpochUs, dateTime, sizeof(dateTime));
 
-        // check if frame number is correct
-        int frame_number = pResponse[4 + i * MESSAGE_LENGTH];
-        if (frame_number != i + 1) { // Frames are 1-indexed. i is 0-indexed
-            printf("Frame number incorrect\n");
-            continue;
+    // Write data
+    csvAppend(line, "%d, %s, %d, %.2f, %.2f, %.2f, %.2f, %.2f, ", 
+            g_line_numbers[pData->batteryID - 1],
+            dateTime, 
+            pData->batteryID, 
+            pData->current, 
+            pData->voltage, 
+            pData->stateOfCharge, 
+            pData->totalCapacity, 
+            pData->remainingCapacity);
+    g_line_numbers[pData->batteryID - 1]++;
+
+    for (int i = 0; i < G_MAX_NUMBER_OF_CELLS; i++) {
+        if (i >= pData->numberOfBatteryCells) {
+            csvAppend(line, " , ");
+        } else {
+            csvAppend(line, "%.2f, ", pData->cellVoltage[i]);
         }
+    }
 
-        readIndex = i * MESSAGE_LENGTH + 4 + 1; // 4 for the start flage, bms address, command, and data length. 1 for byte 0 being the frame serial number
+    csvAppend(line, "%.2f, %.2f, ", 
+            pData->highestCellVoltage, 
+            pData->lowestCellVoltage);
 
-        for (int j = 0; j < CELLS_PER_FRAME; j++) {
-            if (nCellsRead == g_number_of_battery_cells) {
-                break;
-            }
-            cell_voltages[nCellsRead] = (pResponse[readIndex] << 8) + pResponse[readIndex + 1];
+    for (int i = 0; i < G_MAX_NUMBER_OF_TEMP_SENSORS; i++) {
+        if (i >= pData->numberOfTempSensors) {
+            csvAppend(line, " , ");
+        } else {
+            csvAppend(line, "%.2f, ", pData->temperatures[i]);
+        }
+    }
 
-            bmsData.cellVoltage[nCellsRead] = cell_voltages[nCellsRead];
+    csvAppend(line, "%d, %d, %d, %d, ", 
+            pData->chargingDischargingStatus, 
+            pData->chargingMOSStatus, 
+            pData->dischargingMOSStatus, 
+            pData->balancingStatus);
 
-            printf("cell_voltages[%d]: %.2fmV\n", nCellsRead, cell_voltages[nCellsRead]);
-            nCellsRead++;
-            readIndex += 2;
-        }
+    // Combine cellBalancingStatus[i] into a single string
+    // Only the pack's own cells, and none while 0x94 hasn't told us the count (-1). Anything left
+    // uninitialised could hold a newline and split the journal record
+    char cellBalancingStr[G_MAX_NUMBER_OF_CELLS + 1]; // +1 for the null-terminator
+    int nCells = pData->numberOfBatteryCells;
+    if (nCells < 0) nCells = 0;
+    if (nCells > G_MAX_NUMBER_OF_CELLS) nCells = G_MAX_NUMBER_OF_CELLS;
+
+    for (int i = 0; i < nCells; i++) {
+        cellBalancingStr[i] = pData->cellBalancingStatus[i] + '0'; // '0' or '1'
     }
-}
+    cellBalancingStr[nCells] = '\0'; // Null-terminate the string
 
-int parseBmsResponseSingleCellTemp(unsigned char *pResponse) {
-    int cell_temps[G_MAX_NUMBER_OF_CELLS];
+    // output the string to the csv file
+    csvAppend(line, "\'%s\', ", cellBalancingStr);    
 
-    const int MESSAGE_LENGTH = 13;
-    const int MAX_FRAMES = 3;
-    const int CELLS_PER_FRAME = 7;
-    const int TEMPERATURE_OFFSET = 40;
+    for (int i = 0; i < 8; i++) {
+        csvAppend(line, "\'%s\', ", pData->alarms[i]);
+    }
 
-    int nRead = 0; // number of temperature sensors read
-    // Data bits start at index 4
-    int readIndex = 4;
+    csvAppend(line, "%lld, ", sampleEpochUs);
 
-    for (int i = 0; i < MAX_FRAMES; i++) {
-        if (nRead == g_number_of_temp_sensors) {
-            break;
+    // Request times relative to the start of the cycle. Blank if the command got no reply
+    for (int i = 0; i < G_NUMBER_OF_COMMANDS; i++) {
+        if (pData->commandMonoUs[i] == 0) {
+            csvAppend(line, " , ");
+        } else {
+            csvAppend(line, "%lld, ", pData->commandMonoUs[i] - pData->cycleStartMonoUs);
         }
+    }
 
-        // check if frame number is correct
-        int frame_number = pResponse[4 + i * MESSAGE_LENGTH];
-        if (frame_number != i + 1) { // Frames are 1-indexed. i is 0-indexed
-            printf("Frame number incorrect\n");
-            continue;
-        }
+    printf("Data written to csv file\n");
 
-        readIndex = i * MESSAGE_LENGTH + 4 + 1; // 4 for the start flage, bms address, command, and data length. 1 for byte 0 being the frame serial number
+    return 0;
+}
 
-        for (int j = 0; j < CELLS_PER_FRAME; j++) {
-            if (nRead == g_number_of_temp_sensors) {
-                break;
+// Polls 0x90 and 0x95 from every pack back to back until the next row is due, keeping the samples
+// in each pack's pre-trigger ring. Nothing is written unless a trigger fires. An event in progress
+// keeps the loop at full rate past the deadline until its post-trigger window has been captured.
+int burstPollUntil(DalyBmsContext *ctx, long long deadlineMonoUs) {
+    int nEventsActive = 0;
+
+    // Dumping every frame to the console would throttle the sample rate the ring depends on
+    int verbose = ctx->verbose;
+    ctx->verbose = 0;
+
+    while (getMonotonicUs() < deadlineMonoUs || nEventsActive > 0) {
+        nEventsActive = 0;
+        for (int p = 0; p < ctx->numberOfPacks; p++) {
+            EnterCriticalSection(&g_file_lock);
+            burstSamplePack(ctx, &ctx->packs[p], &bursts[p]);
+            LeaveCriticalSection(&g_file_lock);
+            if (bursts[p].hEventFile != INVALID_HANDLE_VALUE) {
+                nEventsActive++;
             }
-            cell_temps[nRead] = pResponse[readIndex] - TEMPERATURE_OFFSET;
-
-            bmsData.temperatures[nRead] = cell_temps[nRead];
-
-            printf("cell_temps[%d]: %dC\n", nRead, cell_temps[nRead]);
-            nRead++;
-            readIndex++;
         }
+        journalCommitIfDue();
     }
+
+    ctx->verbose = verbose;
+    return 0;
 }
 
-int parseBmsResponseSingleCellBalancingStatus(unsigned char *pResponse) {
-    // Data bits start at index 4
-    // Balance Status' are stored in reverse order. I.e. balance_status[0] is the balance status of the last cell
+// Takes one fast sample from a pack and runs its trigger. Returns 0 if the pack missed a reply
+int burstSamplePack(DalyBmsContext *ctx, BMSData *pData, BurstCapture *pBurst) {
+    const int SOC_INDEX = 0;
+    const int CELL_VOLTAGE_INDEX = READ_BAT_SINGLE_CELL_VOLTAGE - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC;
+
+    pData->commandMonoUs[SOC_INDEX] = 0;
+    pData->commandMonoUs[CELL_VOLTAGE_INDEX] = 0;
+    getBMSData(ctx, pData, READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC);
+    getBMSData(ctx, pData, READ_BAT_SINGLE_CELL_VOLTAGE);
+    if (++pBurst->nSamplesPolled % BURST_FAILURE_POLL_DIVIDER == 0) {
+        getBMSData(ctx, pData, READ_BAT_SINGLE_CELL_FAILURE_STATUS);
+    }
 
-    boolean isBalancing = 0;
+    if (pData->commandMonoUs[SOC_INDEX] == 0 || pData->commandMonoUs[CELL_VOLTAGE_INDEX] == 0) {
+        // Missed a reply, don't keep a half stale sample
+        if (pBurst->hEventFile != INVALID_HANDLE_VALUE &&
+            getMonotonicUs() - pBurst->triggerMonoUs >= (long long)g_trigger_post_ms * 1000) {
+            closeEventFile(pBurst);
+        }
+        return 0;
+    }
 
-    for (int i = g_number_of_battery_cells - 1; i >= 0; i--) {
-        isBalancing = isBalancing || pResponse[4 + i];
-        bmsData.cellBalancingStatus[i] = pResponse[4 + i];
+    BurstSample *sample = &pBurst->ring[pBurst->head];
+    sample->monoUs = pData->commandMonoUs[CELL_VOLTAGE_INDEX];
+    if (pData->commandMonoUs[SOC_INDEX] > sample->monoUs) {
+        sample->monoUs = pData->commandMonoUs[SOC_INDEX];
     }
+    sample->current = pData->current;
+    sample->voltage = pData->voltage;
+    memcpy(sample->cellVoltage, pData->cellVoltage, sizeof(sample->cellVoltage));
 
-    for (int i = 0; i < g_number_of_battery_cells; i++) {
-        printf("bmsData.cellBalancingStatus[%d]: %d\n", i, bmsData.cellBalancingStatus[i]);
+    pBurst->head = (pBurst->head + 1) % BURST_RING_CAPACITY;
+    if (pBurst->count < BURST_RING_CAPACITY) {
+        pBurst->count++;
     }
 
+    if (pBurst->hEventFile != INVALID_HANDLE_VALUE) {
+        writeBurstSample(pData, pBurst, sample);
+        if (sample->monoUs - pBurst->triggerMonoUs >= (long long)g_trigger_post_ms * 1000) {
+            closeEventFile(pBurst);
+        }
+        return 1;
+    }
 
-    bmsData.balancingStatus = isBalancing;
+    const char *reason = checkBurstTrigger(pData);
+    if (reason == NULL) {
+        pBurst->armed = 1;
+    } else if (pBurst->armed) {
+        pBurst->armed = 0;
+        pBurst->triggerMonoUs = sample->monoUs;
+        if (openEventFile(pData, pBurst, reason)) {
+            // Write out the pre-trigger window, oldest first. The newest sample is the trigger
+            for (int i = pBurst->count; i > 0; i--) {
+                const BurstSample *history = &pBurst->ring[(pBurst->head - i + BURST_RING_CAPACITY) % BURST_RING_CAPACITY];
+                if (pBurst->triggerMonoUs - history->monoUs <= (long long)g_trigger_pre_ms * 1000) {
+                    writeBurstSample(pData, pBurst, history);
+                }
+            }
+            FlushFileBuffers(pBurst->hEventFile);
+            pBurst->lastFlushMonoUs = getMonotonicUs();
+        }
+    }
+    return 1;
 }
 
-int parseBmsResponseBatteryFailureStatus(unsigned char *pResponse) {
-    // Data bits start at index 4
-    // Alarms' are stored in reverse bit order. I.e. alarms[i][0] is the alarm of the ith byte, last bit
+// Returns a description of the condition that fired, or NULL if none did
+const char *checkBurstTrigger(const BMSData *pData) {
+    if (g_trigger_current_a > 0 && fabsf(pData->current) >= g_trigger_current_a) {
+        return "current";
+    }
 
-    char alarms[8][9];  // 8 bytes, each with 8 bits + null-terminator
-    
-    for (int i = 0; i < 8; ++i) {
-        int byte = pResponse[4 + i];  // start from pResponse[4]
-        char *currentString = alarms[i];
-        
-        for (int j = 7; j >= 0; --j) {  // loop through each bit in byte
-            currentString[j] = ((byte >> j) & 1) ? '1' : '0';
+    if (g_trigger_cell_delta_mv > 0 && pData->numberOfBatteryCells > 0) {
+        float highest = pData->cellVoltage[0];
+        float lowest = pData->cellVoltage[0];
+        for (int i = 1; i < pData->numberOfBatteryCells && i < G_MAX_NUMBER_OF_CELLS; i++) {
+            if (pData->cellVoltage[i] > highest) highest = pData->cellVoltage[i];
+            if (pData->cellVoltage[i] < lowest) lowest = pData->cellVoltage[i];
+        }
+        if (highest - lowest >= g_trigger_cell_delta_mv) {
+            return "cell delta";
         }
-        currentString[8] = '\0';  // null-terminate the string
     }
-    
-    for (int i = 0; i < 8; ++i) {
-        strcpy(bmsData.alarms[i], alarms[i]);
-        printf("Binary string for byte %d: %s\n", i, alarms[i]);
+
+    for (int i = 0; i < 8; i++) {
+        if (strchr(pData->alarms[i], '1') != NULL) {
+            return "failure status";
+        }
     }
+    return NULL;
 }
 
-FILE *openCsvFile() {
-    // Get current date and time
-    time_t raw_time;
-    struct tm *tm_info;
-
-    time(&raw_time);
-    tm_info = localtime(&raw_time);
-
-    char dateTime[14];
-    // Store date and time in dateTime array
-    snprintf(dateTime, sizeof(dateTime), "%02d%02d%02d_%02d%02d%02d", 
-             (tm_info->tm_year + 1900) % 100, 
-             tm_info->tm_mon + 1, 
-             tm_info->tm_mday, 
-             tm_info->tm_hour, 
-             tm_info->tm_min, 
-             tm_info->tm_sec);
-
-
-    char filePrefix[7] = "EPData";    
-    char fileName[30];
+int openEventFile(const BMSData *pData, BurstCapture *pBurst, const char *reason) {
+    char dateTime[32];
+    formatTimestamp(monotonicToEpochUs(pData, pBurst->triggerMonoUs), dateTime, sizeof(dateTime));
 
-    strcpy(fileName, filePrefix);  // Initialize fileName with filePrefix
-    strcat(fileName, dateTime);    // Concatenate dateTime to fileName
-    strcat(fileName, ".csv");      // Concatenate ".csv" to fileName
+    // EPEventYYMMDD_HHMMSS_<address>.csv, built from the "YYYY-MM-DD HH:MM:SS" timestamp
+    snprintf(pBurst->eventFileName, sizeof(pBurst->eventFileName), "EPEvent%.2s%.2s%.2s_%.2s%.2s%.2s_%02d.csv",
+             dateTime + 2, dateTime + 5, dateTime + 8, dateTime + 11, dateTime + 14, dateTime + 17, pData->batteryID);
 
-    FILE *fp = fopen(fileName, "w");
-
-    if (fp == NULL) {
-        printf("Could not open file for writing.\n");
-        return NULL;
+    pBurst->hEventFile = CreateFile(pBurst->eventFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pBurst->hEventFile == INVALID_HANDLE_VALUE) {
+        printf("Could not open event file %s\n", pBurst->eventFileName);
+        return 0;
     }
-    return fp;
-}
 
-int printCsvHeader(FILE *fp) {
-    fprintf(fp, "Line #, Timestamp, Battery ID, Current (A), Voltage (V), State Of Charge (%%), Total Capacity, Remaining Capacity (mAH),");
-    
-    // Print cell voltage headers
+    CsvLine line;
+    line.length = 0;
+    csvAppend(&line, "Trigger: %s at %s, BMS address %d\n", reason, dateTime, pData->batteryID);
+    csvAppend(&line, "Timestamp, Epoch (us), Time From Trigger (us), Current (A), Voltage (V),");
     for (int i = 1; i <= G_MAX_NUMBER_OF_CELLS; ++i) {
-        fprintf(fp, "Cell Voltage %d (mV),", i);
-    }
-    
-    fprintf(fp, "Highest Cell Voltage (mV), Lowest Cell Voltage (mV),");
-    
-    // Print temperature headers
-    for (int i = 1; i <= G_MAX_NUMBER_OF_TEMP_SENSORS; ++i) {
-        fprintf(fp, "Temperature %d (C),", i);
+        csvAppend(&line, "Cell Voltage %d (mV),", i);
     }
-    
-    fprintf(fp, "Charging (1) Discharging (2) Status, Charging MOS Status, Discharging MOS Status, Balancing Status, Cell Balancing Status,");
+    csvAppend(&line, "\n");
 
-    // Print alarm headers
-    for (int i = 1; i <= 8; ++i) {
-        fprintf(fp, "Alarm %d,", i);
-    }
+    DWORD bytesWritten;
+    WriteFile(pBurst->hEventFile, line.text, line.length, &bytesWritten, NULL);
 
-    fprintf(fp, "\n");  // New line at the end
+    printf("Event triggered by %s, capturing to %s\n", reason, pBurst->eventFileName);
+    return 1;
 }
 
-int outputBMSDataToCsv(FILE *fp) {
-    // Write data
-    fprintf(fp, "%d, %s, %d, %.2f, %.2f, %.2f, %.2f, %.2f, ", 
-            bmsData.lineNumber,
-            bmsData.dateTime, 
-            bmsData.batteryID, 
-            bmsData.current, 
-            bmsData.voltage, 
-            bmsData.stateOfCharge, 
-            bmsData.totalCapacity, 
-            bmsData.remainingCapacity);
-    bmsData.lineNumber++;
+int writeBurstSample(const BMSData *pData, BurstCapture *pBurst, const BurstSample *sample) {
+    long long epochUs = monotonicToEpochUs(pData, sample->monoUs);
+    char dateTime[32];
+    formatTimestamp(epochUs, dateTime, sizeof(dateTime));
+
+    CsvLine line;
+    line.length = 0;
+    csvAppend(&line, "%s, %lld, %lld, %.2f, %.2f, ", dateTime, epochUs,
+              sample->monoUs - pBurst->triggerMonoUs, sample->current, sample->voltage);
 
     for (int i = 0; i < G_MAX_NUMBER_OF_CELLS; i++) {
-        if (i >= g_number_of_battery_cells) {
-            fprintf(fp, " , ");
+        if (i >= pData->numberOfBatteryCells) {
+            csvAppend(&line, " , ");
         } else {
-            fprintf(fp, "%.2f, ", bmsData.cellVoltage[i]);
+            csvAppend(&line, "%.2f, ", sample->cellVoltage[i]);
         }
     }
+    csvAppend(&line, "\n");
 
-    fprintf(fp, "%.2f, %.2f, ", 
-            bmsData.highestCellVoltage, 
-            bmsData.lowestCellVoltage);
-
-    for (int i = 0; i < G_MAX_NUMBER_OF_TEMP_SENSORS; i++) {
-        if (i >= g_number_of_temp_sensors) {
-            fprintf(fp, " , ");
-        } else {
-            fprintf(fp, "%.2f, ", bmsData.temperatures[i]);
-        }
+    DWORD bytesWritten;
+    if (!WriteFile(pBurst->hEventFile, line.text, line.length, &bytesWritten, NULL)) {
+        printf("Could not write to event file %s\n", pBurst->eventFileName);
+        return 0;
     }
 
-    fprintf(fp, "%d, %d, %d, %d, ", 
-            bmsData.chargingDischargingStatus, 
-            bmsData.chargingMOSStatus, 
-            bmsData.dischargingMOSStatus, 
-            bmsData.balancingStatus);
+    // Same bounded loss window as the journal
+    if (getMonotonicUs() - pBurst->lastFlushMonoUs >= (long long)g_commit_interval_ms * 1000) {
+        FlushFileBuffers(pBurst->hEventFile);
+        pBurst->lastFlushMonoUs = getMonotonicUs();
+    }
+    return 1;
+}
 
-    // Combine cellBalancingStatus[i] into a single string
-    char cellBalancingStr[G_MAX_NUMBER_OF_CELLS + 1]; // +1 for the null-terminator
-    cellBalancingStr[G_MAX_NUMBER_OF_CELLS] = '\0'; // Null-terminate the string
+int closeEventFile(BurstCapture *pBurst) {
+    FlushFileBuffers(pBurst->hEventFile);
+    CloseHandle(pBurst->hEventFile);
+    pBurst->hEventFile = INVALID_HANDLE_VALUE;
+    printf("Event capture written to %s\n", pBurst->eventFileName);
+    return 1;
+}
 
-    for (int i = 0; i < g_number_of_battery_cells; i++) {
-        cellBalancingStr[i] = bmsData.cellBalancingStatus[i] + '0'; // '0' or '1'
+// Library callback. Each pack's row is journaled as soon as its cycle is complete
+void onBmsSample(const BMSData *pData, int requestType, void *pUserData) {
+    (void)pUserData;
+    if (requestType != BMS_CYCLE_COMPLETE) {
+        return;
     }
 
-    // output the string to the csv file
-    fprintf(fp, "\'%s\', ", cellBalancingStr);    
+    char dateTime[32];
+    formatTimestamp(monotonicToEpochUs(pData, pData->sampleMonoUs), dateTime, sizeof(dateTime));
+    printf("\n\nCurrent Time: %s, BMS address %d\n", dateTime, pData->batteryID);
 
-    for (int i = 0; i < 8; i++) {
-        fprintf(fp, "\'%s\', ", bmsData.alarms[i]);
-    }
+    CsvLine line;
+    line.length = 0;
+    outputBMSDataToCsv(&line, pData);
+    EnterCriticalSection(&g_file_lock);
+    journalAppend(&line);
+    LeaveCriticalSection(&g_file_lock);
+}
 
-    fprintf(fp, "\n");
+// Ctrl+C, Ctrl+Break and closing the console window are the only ways a session ends. Commit and
+// seal the journal here so the last segment isn't left padded to SEGMENT_SIZE_BYTES until the next
+// startup has to recover it
+BOOL WINAPI onConsoleCtrl(DWORD ctrlType) {
+    (void)ctrlType;  // Every event it is registered for ends the process
+    EnterCriticalSection(&g_file_lock);
 
-    printf("Data written to csv file\n");
+    for (int p = 0; p < G_MAX_NUMBER_OF_PACKS; p++) {
+        if (bursts[p].hEventFile != INVALID_HANDLE_VALUE) {
+            closeEventFile(&bursts[p]);
+        }
+    }
+    if (journal.hFile != INVALID_HANDLE_VALUE) {
+        sealJournalSegment();
+        printf("Closed %s\n", journal.fileName);
+    }
 
-    return 0;
+    ExitProcess(0);
+    return TRUE;
 }
 
-
 int main(int argc, char *argv[]) {
-    bmsData.lineNumber = 1;
+    DalyBmsContext bms;
+    initBmsContext(&bms);
+    InitializeCriticalSection(&g_file_lock);
+    journal.hFile = INVALID_HANDLE_VALUE;
+
+    for (int p = 0; p < G_MAX_NUMBER_OF_PACKS; p++) {
+        g_line_numbers[p] = 1;
+        bursts[p].hEventFile = INVALID_HANDLE_VALUE;
+        bursts[p].armed = 1;
+    }
     int comPort = NO_COM_PORT_NUMBER_SUPPLIED;
     comPort = readProgramParams(argc, argv);
-    if (comPort == INVALID_COM_PORT_NUMBER || comPort == INVALID_DELAY_TIME_SUPPLIED) {
-        return 1; // Invalid COM port number or delay time supplied.
+    if (comPort == INVALID_COM_PORT_NUMBER || comPort == INVALID_DELAY_TIME_SUPPLIED ||
+        comPort == INVALID_JOURNAL_OPTION_SUPPLIED || comPort == INVALID_TRIGGER_OPTION_SUPPLIED ||
+        comPort == INVALID_BMS_ADDRESS_SUPPLIED) {
+        return 1; // Invalid COM port number, delay time, journal, trigger or address option supplied.
     }
 
-    HANDLE hComm = setupCOMPort(comPort);
+    bms.maxBmsAddress = g_max_bms_address;
+    bms.hostAddressBase = g_host_address_base;
+    bms.alignSamples = g_align_samples;
+    bms.verbose = 1;
+
+    HANDLE hComm = setupCOMPort(&bms, comPort);
 
     if (hComm == INVALID_HANDLE_VALUE) return 1; // Could not open COM port.
 
-    printf("Opening serial port successful\n");
+    printf("Opening serial port successful, %d BMS found\n", bms.numberOfPacks);
+
+    recoverJournalSegments();
 
-    FILE *fp = openCsvFile();
-    printCsvHeader(fp);
+    printCsvHeader(&journal.header);
+    if (!openJournalSegment()) return 1; // Could not open log file.
+
+    if (!SetConsoleCtrlHandler(onConsoleCtrl, TRUE)) {
+        printf("Could not register the console control handler, the last segment will be sealed on the next start\n");
+    }
+
+    setBmsSampleCallback(&bms, onBmsSample, NULL);
 
     while (1) {
-        getDateTime();
-        getBMSData(hComm, READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC);
-        getBMSData(hComm, READ_BAT_HIGHEST_LOWEST_VOLTAGE);
-        getBMSData(hComm, READ_BAT_MAX_MIN_TEMP);
-        getBMSData(hComm, READ_BAT_CHARGE_DISCHARGE_MOS_STATUS);
-        getBMSData(hComm, READ_BAT_STATUS_INFO_1);
-        getBMSData(hComm, READ_BAT_SINGLE_CELL_VOLTAGE);
-        getBMSData(hComm, READ_BAT_SINGLE_CELL_TEMP);
-        getBMSData(hComm, READ_BAT_SINGLE_CELL_BALANCE_STATUS);
-        getBMSData(hComm, READ_BAT_SINGLE_CELL_FAILURE_STATUS);
+        pollAllPacks(&bms);
+        journalCommitIfDue();
 
-        outputBMSDataToCsv(fp);
-        Sleep(g_delay_time_ms);
+        if (g_trigger_enabled) {
+            // Sample at full rate into the pre-trigger ring until the next row is due
+            burstPollUntil(&bms, bms.packs[0].cycleStartMonoUs + (long long)g_delay_time_ms * 1000);
+        } else {
+            sleepUntil(getMonotonicUs() + (long long)g_delay_time_ms * 1000);
+        }
     }
 
     // Close the file
-    fclose(fp);
+    sealJournalSegment();
     // Close the COM port
-    CloseHandle(hComm);
+    closeBmsContext(&bms);
     return 0;
 }
@@ -1,8 +1,19 @@
 REM ========================================
 REM Read data from Daly BMS
-REM Usage: EPDataLog.exe -t [Interval Time(ms)] -c [COM Port Number]
+REM Build: gcc EPDataLog.c DalyBms.c -o EPDataLog.exe
+REM DalyBms.h / DalyBms.c can also be built into other programs to get decoded samples through a callback
+REM Usage: EPDataLog.exe -t [Interval Time(ms)] -c [COM Port Number] -n [Highest BMS Address] -ha [Host Address Base] -a -w [Commit Window(ms)] -r [Rotation Time(min)] -e -ei [Current(A)] -ed [Cell Delta(mV)] -eb [Pre-trigger(ms)] -ea [Post-trigger(ms)]
 REM Interval Time: the time interval between two data logs
 REM COM Port Number: the COM port number of the device
+REM Highest BMS Address: BMS addresses 1 to this are searched for on the RS-485 bus and polled, default 1
+REM Host Address Base: requests to BMS address n are sent with host byte this + n, default 63 (0x3F)
+REM   so address 1 uses the documented PC address 0x40. Addressing more packs this way is unverified
+REM -a: interpolate current and voltage to the instant the cell voltages were read
+REM Commit Window: longest time a record is held in memory before being flushed to disk, default 1000
+REM Rotation Time: minutes before starting a new log segment, default 60, 0 rotates by size only
+REM -e: poll current and cell voltages at full rate between logs and capture events to EPEvent*.csv
+REM   An event fires on any failure status bit, on |current| >= -ei, or on highest - lowest cell voltage >= -ed
+REM   -eb and -ea set how much history before and how long after the trigger is written, default 5000 each
 REM Interval Time and COM Port are optional, default value is 2000 and will autodetect the correct COM Port
 REM Example: EPDataLog.exe -t 5000 -c 3
 REM this is log one data every 5000 ms, communicating via COM3
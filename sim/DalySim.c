@@ -0,0 +1,618 @@
+// Daly BMS simulator for Linux
+// Emulates Daly BMS devices on pseudo-terminals and answers the 0x90 to 0x98 requests the
+// same way a real pack does, including the multi-frame 0x95 and 0x96 replies. Each pseudo-terminal
+// is one RS-485 bus carrying one or more BMS addresses.
+//
+// Build: gcc -O2 -o sim/DalySim sim/DalySim.c -lm
+// Usage: sim/DalySim -b [Buses] -d [Devices Per Bus] -c [Cells] -T [Temp Sensors] -o [Port List File]
+//                    -l [Latency(ms)] -j [Jitter(ms)] -r [Reply Drop %] -p [Byte Drop %] -x [Bad Checksum %]
+//                    -P [Profile Period(s)] -s [Seed] -t [Run Time(s)] -H [Host Address Base] -B [Baud Rate]
+// The slave device of every bus is printed, one per line, and written to the port list file.
+// Runs until Ctrl+C, or for the run time if one is given, then prints per bus statistics.
+// Requests and replies take as long as they would on a real line at the baud rate (default 9600,
+// 8N1), so the load test measures real RS-485 throughput. -B 0 sends replies in one go.
+// A device answers requests whose host byte is the host address base + its address. That is the
+// same unverified multi-drop scheme the library assumes (see DEFAULT_HOST_ADDRESS_BASE), so a
+// multi-device bus here tests the host's scheduling and fault handling, not compatibility with real
+// Daly firmware.
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../DalyBms.h"
+
+#define SIM_MAX_BUSES                               1024
+#define SIM_MAX_TEMP_SENSORS                        G_MAX_NUMBER_OF_TEMP_SENSORS
+#define SIM_MAX_REPLY_LENGTH                        (16 * FRAME_LENGTH)  // 48 cells in 0x95
+#define CELL_INTERNAL_RESISTANCE_MOHM               2.0
+#define BITS_PER_BYTE                               10  // 8N1: start bit, 8 data bits, stop bit
+
+// Simulated Device Structure
+typedef struct {
+    int address;
+    int numberOfCells;
+    int numberOfTempSensors;
+    double capacityAh;
+    double stateOfCharge;                   // %
+    double current;                         // A, positive while charging
+    double phaseS;                          // Offset into the charge / discharge profile
+    double cellOffsetMv[G_MAX_NUMBER_OF_CELLS];
+    double temperature[SIM_MAX_TEMP_SENSORS];
+    long long lastUpdateUs;
+} SimDevice;
+
+// Simulated Bus Structure
+typedef struct {
+    int masterFd;
+    int slaveFd;                            // Held open so the master never sees a hang-up
+    char slaveName[64];
+    SimDevice devices[G_MAX_NUMBER_OF_PACKS];
+    int numberOfDevices;
+    unsigned char rx[4 * FRAME_LENGTH];
+    int rxLength;
+    // Half duplex, so there is at most one reply waiting to go out
+    unsigned char tx[SIM_MAX_REPLY_LENGTH];
+    int txLength;
+    int txSent;                             // Bytes of tx already released onto the line
+    long long txDueUs;                      // When the first byte of the reply goes out
+    unsigned long requests;
+    unsigned long replies;
+    unsigned long droppedReplies;
+    unsigned long droppedBytes;
+    unsigned long corruptedFrames;
+    unsigned long badRequests;
+} SimBus;
+
+// Global Vars
+int g_number_of_buses = 1;
+int g_devices_per_bus = 1;
+int g_number_of_cells = 16;
+int g_number_of_temp_sensors = 2;
+int g_latency_ms = 20;
+int g_jitter_ms = 0;
+double g_reply_drop_percent = 0;
+double g_byte_drop_percent = 0;
+double g_corrupt_percent = 0;
+double g_profile_period_s = 600;
+double g_discharge_current_a = 40;
+double g_charge_current_a = 20;
+unsigned int g_seed = 1;
+int g_run_time_s = 0;
+int g_host_address_base = DEFAULT_HOST_ADDRESS_BASE;
+int g_baud_rate = 9600;
+long long g_byte_time_us = 0;               // Time one byte takes on the line. 0 when unpaced
+const char *g_port_list_file = NULL;
+volatile sig_atomic_t g_running = 1;
+
+SimBus *buses;
+
+int readSimParams(int argc, char *argv[]);
+long long getSimTimeUs();
+double randomPercent();
+int openSimBus(SimBus *pBus, int busIndex);
+int initSimDevice(SimDevice *pDevice, int busIndex, int address);
+int updateSimDevice(SimDevice *pDevice, long long nowUs);
+int handleSimRequest(SimBus *pBus, const unsigned char *pRequest, long long nowUs);
+int buildSimReply(SimDevice *pDevice, int requestType, unsigned char *pReply);
+int startSimFrame(unsigned char *pFrame, int address, int requestType);
+int finishSimFrame(unsigned char *pFrame);
+int readSimBus(SimBus *pBus, long long nowUs);
+int flushSimBus(SimBus *pBus, long long nowUs);
+long long nextSimByteUs(const SimBus *pBus);
+int printSimStats();
+void onSimSignal(int signalNumber);
+
+
+int readSimParams(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            printf("Error: Missing value for %s option\n", argv[i]);
+            return 0;
+        }
+
+        const char *value = argv[++i];
+        if (strcmp(argv[i - 1], "-b") == 0) {
+            g_number_of_buses = atoi(value);
+        } else if (strcmp(argv[i - 1], "-d") == 0) {
+            g_devices_per_bus = atoi(value);
+        } else if (strcmp(argv[i - 1], "-c") == 0) {
+            g_number_of_cells = atoi(value);
+        } else if (strcmp(argv[i - 1], "-T") == 0) {
+            g_number_of_temp_sensors = atoi(value);
+        } else if (strcmp(argv[i - 1], "-l") == 0) {
+            g_latency_ms = atoi(value);
+        } else if (strcmp(argv[i - 1], "-j") == 0) {
+            g_jitter_ms = atoi(value);
+        } else if (strcmp(argv[i - 1], "-r") == 0) {
+            g_reply_drop_percent = atof(value);
+        } else if (strcmp(argv[i - 1], "-p") == 0) {
+            g_byte_drop_percent = atof(value);
+        } else if (strcmp(argv[i - 1], "-x") == 0) {
+            g_corrupt_percent = atof(value);
+        } else if (strcmp(argv[i - 1], "-P") == 0) {
+            g_profile_period_s = atof(value);
+        } else if (strcmp(argv[i - 1], "-s") == 0) {
+            g_seed = (unsigned int)atoi(value);
+        } else if (strcmp(argv[i - 1], "-t") == 0) {
+            g_run_time_s = atoi(value);
+        } else if (strcmp(argv[i - 1], "-B") == 0) {
+            g_baud_rate = atoi(value);
+        } else if (strcmp(argv[i - 1], "-H") == 0) {
+            g_host_address_base = atoi(value);
+        } else if (strcmp(argv[i - 1], "-o") == 0) {
+            g_port_list_file = value;
+        } else {
+            printf("Error: Unknown option %s\n", argv[i - 1]);
+            return 0;
+        }
+    }
+
+    if (g_number_of_buses < 1 || g_number_of_buses > SIM_MAX_BUSES) {
+        printf("Error: Number of buses must be between 1 and %d\n", SIM_MAX_BUSES);
+        return 0;
+    }
+    if (g_devices_per_bus < 1 || g_devices_per_bus > G_MAX_NUMBER_OF_PACKS) {
+        printf("Error: Devices per bus must be between 1 and %d\n", G_MAX_NUMBER_OF_PACKS);
+        return 0;
+    }
+    if (g_number_of_cells < 1 || g_number_of_cells > G_MAX_NUMBER_OF_CELLS) {
+        printf("Error: Number of cells must be between 1 and %d\n", G_MAX_NUMBER_OF_CELLS);
+        return 0;
+    }
+    if (g_number_of_temp_sensors < 1 || g_number_of_temp_sensors > SIM_MAX_TEMP_SENSORS) {
+        printf("Error: Number of temperature sensors must be between 1 and %d\n", SIM_MAX_TEMP_SENSORS);
+        return 0;
+    }
+    if (g_latency_ms < 0 || g_jitter_ms < 0 || g_profile_period_s <= 0 || g_baud_rate < 0) {
+        printf("Error: Latency, jitter, profile period and baud rate cannot be negative\n");
+        return 0;
+    }
+    g_byte_time_us = g_baud_rate > 0 ? BITS_PER_BYTE * 1000000LL / g_baud_rate : 0;
+    return 1;
+}
+
+long long getSimTimeUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+double randomPercent() {
+    return rand() * 100.0 / ((double)RAND_MAX + 1.0);
+}
+
+int openSimBus(SimBus *pBus, int busIndex) {
+    memset(pBus, 0, sizeof(SimBus));
+
+    pBus->masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (pBus->masterFd < 0 || grantpt(pBus->masterFd) != 0 || unlockpt(pBus->masterFd) != 0) {
+        printf("Could not create a pseudo-terminal: %s\n", strerror(errno));
+        return 0;
+    }
+    snprintf(pBus->slaveName, sizeof(pBus->slaveName), "%s", ptsname(pBus->masterFd));
+
+    // Open the slave once in raw mode so the line discipline never echoes or translates bytes
+    pBus->slaveFd = open(pBus->slaveName, O_RDWR | O_NOCTTY);
+    struct termios tty;
+    if (pBus->slaveFd < 0 || tcgetattr(pBus->slaveFd, &tty) != 0) {
+        printf("Could not open %s: %s\n", pBus->slaveName, strerror(errno));
+        return 0;
+    }
+    cfmakeraw(&tty);
+    tcsetattr(pBus->slaveFd, TCSANOW, &tty);
+
+    fcntl(pBus->masterFd, F_SETFL, fcntl(pBus->masterFd, F_GETFL) | O_NONBLOCK);
+
+    pBus->numberOfDevices = g_devices_per_bus;
+    for (int i = 0; i < pBus->numberOfDevices; i++) {
+        initSimDevice(&pBus->devices[i], busIndex, i + 1);
+    }
+    return 1;
+}
+
+int initSimDevice(SimDevice *pDevice, int busIndex, int address) {
+    memset(pDevice, 0, sizeof(SimDevice));
+    pDevice->address = address;
+    pDevice->numberOfCells = g_number_of_cells;
+    pDevice->numberOfTempSensors = g_number_of_temp_sensors;
+    pDevice->capacityAh = 100;
+    pDevice->stateOfCharge = 20 + randomPercent() * 0.7;
+    pDevice->phaseS = randomPercent() / 100.0 * g_profile_period_s;
+
+    // Small fixed imbalance between cells so cell delta triggers have something to see
+    for (int i = 0; i < pDevice->numberOfCells; i++) {
+        pDevice->cellOffsetMv[i] = (randomPercent() - 50) * 0.2;
+    }
+    for (int i = 0; i < pDevice->numberOfTempSensors; i++) {
+        pDevice->temperature[i] = 22 + randomPercent() * 0.05 + busIndex % 3;
+    }
+    pDevice->lastUpdateUs = getSimTimeUs();
+    return 1;
+}
+
+// Advances the charge / discharge profile. The first 60% of each period discharges with a 3x load
+// step every 30 seconds, the rest charges at constant current.
+int updateSimDevice(SimDevice *pDevice, long long nowUs) {
+    double dtS = (nowUs - pDevice->lastUpdateUs) / 1000000.0;
+    pDevice->lastUpdateUs = nowUs;
+
+    double t = fmod(nowUs / 1000000.0 + pDevice->phaseS, g_profile_period_s);
+    if (t < g_profile_period_s * 0.6) {
+        int loadStep = fmod(t, 30.0) < 2.0;
+        pDevice->current = -g_discharge_current_a * (loadStep ? 3 : 1);
+    } else {
+        pDevice->current = g_charge_current_a;
+    }
+    if ((pDevice->stateOfCharge <= 0 && pDevice->current < 0) || (pDevice->stateOfCharge >= 100 && pDevice->current > 0)) {
+        pDevice->current = 0;
+    }
+
+    pDevice->stateOfCharge += pDevice->current * dtS / 3600.0 / pDevice->capacityAh * 100;
+    pDevice->stateOfCharge = fmin(100, fmax(0, pDevice->stateOfCharge));
+
+    // Temperatures drift towards a point set by the current
+    for (int i = 0; i < pDevice->numberOfTempSensors; i++) {
+        double target = 25 + fabs(pDevice->current) * 0.15;
+        pDevice->temperature[i] += (target - pDevice->temperature[i]) * fmin(1, dtS / 120);
+    }
+    return 1;
+}
+
+// LiFePO4 style open circuit voltage with knees at both ends, plus the IR drop of the current
+double cellVoltageMv(const SimDevice *pDevice, int cell) {
+    double soc = pDevice->stateOfCharge;
+    double ocv = 3200 + soc * 1.5;
+    if (soc < 10) ocv -= (10 - soc) * 25;
+    if (soc > 95) ocv += (soc - 95) * 30;
+    return ocv + pDevice->current * CELL_INTERNAL_RESISTANCE_MOHM + pDevice->cellOffsetMv[cell];
+}
+
+int startSimFrame(unsigned char *pFrame, int address, int requestType) {
+    memset(pFrame, 0, FRAME_LENGTH);
+    pFrame[0] = 0xA5;
+    pFrame[1] = address;
+    pFrame[2] = requestType;
+    pFrame[3] = 0x08;
+    return 0;
+}
+
+int finishSimFrame(unsigned char *pFrame) {
+    int checksum = 0;
+    for (int i = 0; i < FRAME_LENGTH - 1; i++) {
+        checksum += pFrame[i];
+    }
+    pFrame[FRAME_LENGTH - 1] = checksum & 0xFF;
+    return FRAME_LENGTH;
+}
+
+// Builds the reply frames for one request. Returns the reply length in bytes
+int buildSimReply(SimDevice *pDevice, int requestType, unsigned char *pReply) {
+    const int CELLS_PER_FRAME = 3;
+    const int SENSORS_PER_FRAME = 7;
+
+    double cellMv[G_MAX_NUMBER_OF_CELLS];
+    double totalMv = 0;
+    int highest = 0;
+    int lowest = 0;
+    for (int i = 0; i < pDevice->numberOfCells; i++) {
+        cellMv[i] = cellVoltageMv(pDevice, i);
+        totalMv += cellMv[i];
+        if (cellMv[i] > cellMv[highest]) highest = i;
+        if (cellMv[i] < cellMv[lowest]) lowest = i;
+    }
+
+    int hottest = 0;
+    int coldest = 0;
+    for (int i = 1; i < pDevice->numberOfTempSensors; i++) {
+        if (pDevice->temperature[i] > pDevice->temperature[hottest]) hottest = i;
+        if (pDevice->temperature[i] < pDevice->temperature[coldest]) coldest = i;
+    }
+
+    unsigned char *f = pReply;
+    int length = 0;
+
+    switch (requestType) {
+        case READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC: {
+            int voltage = (int)(totalMv / 100);  // 0.1V
+            int current = (int)lround(pDevice->current * 10) + 30000;
+            int soc = (int)(pDevice->stateOfCharge * 10);
+            startSimFrame(f, pDevice->address, requestType);
+            f[4] = voltage >> 8; f[5] = voltage & 0xFF;
+            f[6] = voltage >> 8; f[7] = voltage & 0xFF;
+            f[8] = current >> 8; f[9] = current & 0xFF;
+            f[10] = soc >> 8; f[11] = soc & 0xFF;
+            length = finishSimFrame(f);
+            break;
+        }
+        case READ_BAT_HIGHEST_LOWEST_VOLTAGE: {
+            int highMv = (int)cellMv[highest];
+            int lowMv = (int)cellMv[lowest];
+            startSimFrame(f, pDevice->address, requestType);
+            f[4] = highMv >> 8; f[5] = highMv & 0xFF; f[6] = highest + 1;
+            f[7] = lowMv >> 8; f[8] = lowMv & 0xFF; f[9] = lowest + 1;
+            length = finishSimFrame(f);
+            break;
+        }
+        case READ_BAT_MAX_MIN_TEMP:
+            startSimFrame(f, pDevice->address, requestType);
+            f[4] = (int)pDevice->temperature[hottest] + 40; f[5] = hottest + 1;
+            f[6] = (int)pDevice->temperature[coldest] + 40; f[7] = coldest + 1;
+            length = finishSimFrame(f);
+            break;
+        case READ_BAT_CHARGE_DISCHARGE_MOS_STATUS: {
+            long remainingMah = (long)(pDevice->capacityAh * pDevice->stateOfCharge * 10);
+            startSimFrame(f, pDevice->address, requestType);
+            f[4] = pDevice->current > 0 ? 1 : (pDevice->current < 0 ? 2 : 0);
+            f[5] = 1;
+            f[6] = 1;
+            f[7] = 0;
+            f[8] = (remainingMah >> 24) & 0xFF; f[9] = (remainingMah >> 16) & 0xFF;
+            f[10] = (remainingMah >> 8) & 0xFF; f[11] = remainingMah & 0xFF;
+            length = finishSimFrame(f);
+            break;
+        }
+        case READ_BAT_STATUS_INFO_1:
+            startSimFrame(f, pDevice->address, requestType);
+            f[4] = pDevice->numberOfCells;
+            f[5] = pDevice->numberOfTempSensors;
+            f[6] = pDevice->current > 0;
+            f[7] = pDevice->current < 0;
+            length = finishSimFrame(f);
+            break;
+        case READ_BAT_SINGLE_CELL_VOLTAGE:
+            for (int frame = 0; frame * CELLS_PER_FRAME < pDevice->numberOfCells; frame++) {
+                startSimFrame(f, pDevice->address, requestType);
+                f[4] = frame + 1;
+                for (int j = 0; j < CELLS_PER_FRAME; j++) {
+                    int cell = frame * CELLS_PER_FRAME + j;
+                    int mv = cell < pDevice->numberOfCells ? (int)cellMv[cell] : 0;
+                    f[5 + j * 2] = mv >> 8;
+                    f[6 + j * 2] = mv & 0xFF;
+                }
+                length += finishSimFrame(f);
+                f += FRAME_LENGTH;
+            }
+            break;
+        case READ_BAT_SINGLE_CELL_TEMP:
+            for (int frame = 0; frame * SENSORS_PER_FRAME < pDevice->numberOfTempSensors; frame++) {
+                startSimFrame(f, pDevice->address, requestType);
+                f[4] = frame + 1;
+                for (int j = 0; j < SENSORS_PER_FRAME; j++) {
+                    int sensor = frame * SENSORS_PER_FRAME + j;
+                    f[5 + j] = sensor < pDevice->numberOfTempSensors ? (int)pDevice->temperature[sensor] + 40 : 0;
+                }
+                length += finishSimFrame(f);
+                f += FRAME_LENGTH;
+            }
+            break;
+        case READ_BAT_SINGLE_CELL_BALANCE_STATUS:
+            // Balance every cell more than 5mV above the lowest while charging
+            startSimFrame(f, pDevice->address, requestType);
+            for (int i = 0; i < pDevice->numberOfCells; i++) {
+                if (pDevice->current > 0 && cellMv[i] - cellMv[lowest] > 5) {
+                    f[4 + i / 8] |= 1 << (i % 8);
+                }
+            }
+            length = finishSimFrame(f);
+            break;
+        case READ_BAT_SINGLE_CELL_FAILURE_STATUS:
+            startSimFrame(f, pDevice->address, requestType);
+            if (cellMv[lowest] < 2800) f[4] |= 0x08;  // Cell voltage too low, level 2
+            if (cellMv[highest] > 3650) f[4] |= 0x02;  // Cell voltage too high, level 2
+            length = finishSimFrame(f);
+            break;
+        default:
+            return 0;
+    }
+    return length;
+}
+
+int handleSimRequest(SimBus *pBus, const unsigned char *pRequest, long long nowUs) {
+    int address = pRequest[1] - g_host_address_base;
+    pBus->requests++;
+
+    // A new request on a half-duplex bus means the host gave up on the previous reply
+    pBus->txLength = 0;
+    pBus->txSent = 0;
+
+    for (int i = 0; i < pBus->numberOfDevices; i++) {
+        SimDevice *pDevice = &pBus->devices[i];
+        if (pDevice->address != address) {
+            continue;
+        }
+
+        if (randomPercent() < g_reply_drop_percent) {
+            pBus->droppedReplies++;
+            return 0;
+        }
+
+        updateSimDevice(pDevice, nowUs);
+        pBus->txLength = buildSimReply(pDevice, pRequest[2], pBus->tx);
+        // The pty hands over the request at once, a real line only delivers its last byte after
+        // FRAME_LENGTH byte times. The BMS then takes its processing latency before replying
+        pBus->txDueUs = nowUs + FRAME_LENGTH * g_byte_time_us +
+                        (long long)(g_latency_ms + (g_jitter_ms > 0 ? rand() % (g_jitter_ms + 1) : 0)) * 1000;
+
+        for (int frame = 0; frame < pBus->txLength; frame += FRAME_LENGTH) {
+            if (randomPercent() < g_corrupt_percent) {
+                pBus->tx[frame + FRAME_LENGTH - 1] ^= 0x5A;
+                pBus->corruptedFrames++;
+            }
+        }
+        return 1;
+    }
+    return 0;  // Nobody at that address, the bus stays silent
+}
+
+int readSimBus(SimBus *pBus, long long nowUs) {
+    ssize_t n = read(pBus->masterFd, pBus->rx + pBus->rxLength, sizeof(pBus->rx) - pBus->rxLength);
+    if (n <= 0) {
+        return 0;
+    }
+    pBus->rxLength += (int)n;
+
+    // Pull out whole request frames, resyncing on the start flag after line noise
+    while (pBus->rxLength >= FRAME_LENGTH) {
+        int checksum = 0;
+        for (int i = 0; i < FRAME_LENGTH - 1; i++) {
+            checksum += pBus->rx[i];
+        }
+
+        if (pBus->rx[0] == 0xA5 && (checksum & 0xFF) == pBus->rx[FRAME_LENGTH - 1]) {
+            handleSimRequest(pBus, pBus->rx, nowUs);
+            pBus->rxLength -= FRAME_LENGTH;
+            memmove(pBus->rx, pBus->rx + FRAME_LENGTH, pBus->rxLength);
+        } else {
+            pBus->badRequests++;
+            pBus->rxLength--;
+            memmove(pBus->rx, pBus->rx + 1, pBus->rxLength);
+        }
+    }
+    return 1;
+}
+
+// Releases the bytes of the pending reply that are due by now, one byte time apart at the baud
+// rate, dropping individual bytes if byte drops are enabled
+int flushSimBus(SimBus *pBus, long long nowUs) {
+    unsigned char out[SIM_MAX_REPLY_LENGTH];
+    int outLength = 0;
+
+    int nDue = pBus->txLength;
+    if (g_byte_time_us > 0) {
+        nDue = (int)((nowUs - pBus->txDueUs) / g_byte_time_us) + 1;
+        if (nDue > pBus->txLength) {
+            nDue = pBus->txLength;
+        }
+    }
+
+    for (; pBus->txSent < nDue; pBus->txSent++) {
+        if (g_byte_drop_percent > 0 && randomPercent() < g_byte_drop_percent) {
+            pBus->droppedBytes++;
+            continue;
+        }
+        out[outLength++] = pBus->tx[pBus->txSent];
+    }
+
+    if (outLength > 0 && write(pBus->masterFd, out, outLength) != outLength) {
+        printf("Short write on %s\n", pBus->slaveName);
+    }
+
+    if (pBus->txSent == pBus->txLength) {
+        pBus->txLength = 0;
+        pBus->txSent = 0;
+        pBus->replies++;
+    }
+    return 1;
+}
+
+long long nextSimByteUs(const SimBus *pBus) {
+    return pBus->txDueUs + pBus->txSent * g_byte_time_us;
+}
+
+int printSimStats() {
+    unsigned long totals[6] = {0};
+
+    printf("\n%-14s %10s %10s %10s %10s %10s %10s\n", "Bus", "Requests", "Replies", "No Reply", "Bytes Lost", "Bad CRC", "Bad Req");
+    for (int b = 0; b < g_number_of_buses; b++) {
+        SimBus *pBus = &buses[b];
+        if (g_number_of_buses <= 32) {
+            printf("%-14s %10lu %10lu %10lu %10lu %10lu %10lu\n", pBus->slaveName, pBus->requests, pBus->replies,
+                   pBus->droppedReplies, pBus->droppedBytes, pBus->corruptedFrames, pBus->badRequests);
+        }
+        totals[0] += pBus->requests;
+        totals[1] += pBus->replies;
+        totals[2] += pBus->droppedReplies;
+        totals[3] += pBus->droppedBytes;
+        totals[4] += pBus->corruptedFrames;
+        totals[5] += pBus->badRequests;
+    }
+    printf("%-14s %10lu %10lu %10lu %10lu %10lu %10lu\n", "Total", totals[0], totals[1], totals[2], totals[3], totals[4], totals[5]);
+    return 0;
+}
+
+void onSimSignal(int signalNumber) {
+    (void)signalNumber;
+    g_running = 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (!readSimParams(argc, argv)) {
+        return 1;
+    }
+    srand(g_seed);
+    signal(SIGINT, onSimSignal);
+    signal(SIGTERM, onSimSignal);
+
+    buses = calloc(g_number_of_buses, sizeof(SimBus));
+    struct pollfd *pfds = calloc(g_number_of_buses, sizeof(struct pollfd));
+    if (buses == NULL || pfds == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    FILE *fp = g_port_list_file != NULL ? fopen(g_port_list_file, "w") : NULL;
+    if (g_port_list_file != NULL && fp == NULL) {
+        printf("Could not open %s for writing\n", g_port_list_file);
+        return 1;
+    }
+
+    for (int b = 0; b < g_number_of_buses; b++) {
+        if (!openSimBus(&buses[b], b)) {
+            return 1;
+        }
+        pfds[b].fd = buses[b].masterFd;
+        pfds[b].events = POLLIN;
+        printf("%s\n", buses[b].slaveName);
+        if (fp != NULL) {
+            fprintf(fp, "%s\n", buses[b].slaveName);
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    printf("Simulating %d buses x %d devices, %d cells each\n", g_number_of_buses, g_devices_per_bus, g_number_of_cells);
+    fflush(stdout);
+
+    long long endUs = g_run_time_s > 0 ? getSimTimeUs() + (long long)g_run_time_s * 1000000 : 0;
+
+    while (g_running && (endUs == 0 || getSimTimeUs() < endUs)) {
+        // Sleep until a request arrives or the next reply byte is due
+        long long nowUs = getSimTimeUs();
+        long long nextDueUs = nowUs + 100000;
+        for (int b = 0; b < g_number_of_buses; b++) {
+            if (buses[b].txLength > 0 && nextSimByteUs(&buses[b]) < nextDueUs) {
+                nextDueUs = nextSimByteUs(&buses[b]);
+            }
+        }
+        int timeoutMs = nextDueUs > nowUs ? (int)((nextDueUs - nowUs + 999) / 1000) : 0;
+
+        if (poll(pfds, g_number_of_buses, timeoutMs) < 0 && errno != EINTR) {
+            printf("poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        nowUs = getSimTimeUs();
+        for (int b = 0; b < g_number_of_buses; b++) {
+            if (pfds[b].revents & POLLIN) {
+                readSimBus(&buses[b], nowUs);
+            }
+            if (buses[b].txLength > 0 && nextSimByteUs(&buses[b]) <= nowUs) {
+                flushSimBus(&buses[b], nowUs);
+            }
+        }
+    }
+
+    printSimStats();
+    return 0;
+}
@@ -0,0 +1,237 @@
+// Load test for the DalyBms library against the simulator
+// Polls every bus listed in the port list file written by DalySim, one thread and one
+// DalyBmsContext per bus, and reports throughput, data loss and CPU cost per pack.
+//
+// Build: gcc -O2 -o sim/LoadTest sim/LoadTest.c DalyBms.c -lpthread
+// Usage: sim/DalySim -b 32 -d 16 -o ports.txt &
+//        sim/LoadTest -f ports.txt -n [Highest BMS Address] -s [Run Time(s)] -H [Host Address Base] -a -v
+
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../DalyBms.h"
+
+#define LOAD_TEST_MAX_BUSES                         1024
+
+// Per Bus Load Test State
+typedef struct {
+    char portName[128];
+    DalyBmsContext bms;
+    int numberOfPacks;
+    unsigned long requested;                  // Commands sent by pollAllPacks, one per pack per command per cycle
+    // Replies decoded per command, indexed by command - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC
+    unsigned long decoded[G_NUMBER_OF_COMMANDS];
+    unsigned long cyclesComplete;
+    unsigned long completeRows;               // Cycles where all nine commands were decoded
+    long long cycleTimeUs;                    // Sum of cycle durations, for the mean
+} LoadTestBus;
+
+// Global Vars
+const char *g_port_list_file = "ports.txt";
+int g_max_bms_address = 1;
+int g_run_time_s = 10;
+int g_align_samples = 0;
+int g_verbose = 0;
+int g_host_address_base = DEFAULT_HOST_ADDRESS_BASE;
+
+int readLoadTestParams(int argc, char *argv[]);
+void onLoadTestSample(const BMSData *pData, int requestType, void *pUserData);
+void *pollBus(void *pArg);
+double getCpuSeconds();
+
+
+int readLoadTestParams(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0) {
+            g_align_samples = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-v") == 0) {
+            g_verbose = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            printf("Error: Missing value for %s option\n", argv[i]);
+            return 0;
+        }
+
+        const char *value = argv[++i];
+        if (strcmp(argv[i - 1], "-f") == 0) {
+            g_port_list_file = value;
+        } else if (strcmp(argv[i - 1], "-n") == 0) {
+            g_max_bms_address = atoi(value);
+        } else if (strcmp(argv[i - 1], "-s") == 0) {
+            g_run_time_s = atoi(value);
+        } else if (strcmp(argv[i - 1], "-H") == 0) {
+            g_host_address_base = atoi(value);
+        } else {
+            printf("Error: Unknown option %s\n", argv[i - 1]);
+            return 0;
+        }
+    }
+
+    if (g_max_bms_address < 1 || g_max_bms_address > G_MAX_NUMBER_OF_PACKS) {
+        printf("Error: Highest BMS address must be between 1 and %d\n", G_MAX_NUMBER_OF_PACKS);
+        return 0;
+    }
+    if (g_run_time_s < 1) {
+        printf("Error: Run time must be at least 1 second\n");
+        return 0;
+    }
+    return 1;
+}
+
+void onLoadTestSample(const BMSData *pData, int requestType, void *pUserData) {
+    LoadTestBus *pBus = (LoadTestBus *)pUserData;
+
+    if (requestType != BMS_CYCLE_COMPLETE) {
+        pBus->decoded[requestType - READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC]++;
+        return;
+    }
+
+    pBus->cyclesComplete++;
+    pBus->cycleTimeUs += getMonotonicUs() - pData->cycleStartMonoUs;
+
+    int complete = 1;
+    for (int i = 0; i < G_NUMBER_OF_COMMANDS; i++) {
+        if (pData->commandMonoUs[i] == 0) {
+            complete = 0;
+        }
+    }
+    pBus->completeRows += complete;
+}
+
+void *pollBus(void *pArg) {
+    LoadTestBus *pBus = (LoadTestBus *)pArg;
+    DalyBmsContext *ctx = &pBus->bms;
+
+    ctx->hComm = connectToCOMPort(ctx, pBus->portName);
+    if (ctx->hComm == INVALID_BMS_PORT) {
+        printf("Could not open %s\n", pBus->portName);
+        return NULL;
+    }
+
+    pBus->numberOfPacks = discoverBmsAddresses(ctx);
+    if (pBus->numberOfPacks == 0) {
+        printf("No BMS found on %s\n", pBus->portName);
+        closeBmsContext(ctx);
+        return NULL;
+    }
+
+    long long endUs = getMonotonicUs() + (long long)g_run_time_s * 1000000;
+    while (getMonotonicUs() < endUs) {
+        pollAllPacks(ctx);
+        // Rediscovery runs at the start of pollAllPacks, so this is the number of packs just polled
+        pBus->requested += (unsigned long)ctx->numberOfPacks * G_NUMBER_OF_COMMANDS;
+    }
+    pBus->numberOfPacks = ctx->numberOfPacks;
+
+    closeBmsContext(ctx);
+    return NULL;
+}
+
+double getCpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (!readLoadTestParams(argc, argv)) {
+        return 1;
+    }
+
+    FILE *fp = fopen(g_port_list_file, "r");
+    if (fp == NULL) {
+        printf("Could not open %s\n", g_port_list_file);
+        return 1;
+    }
+
+    LoadTestBus *buses = calloc(LOAD_TEST_MAX_BUSES, sizeof(LoadTestBus));
+    pthread_t *threads = calloc(LOAD_TEST_MAX_BUSES, sizeof(pthread_t));
+    if (buses == NULL || threads == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    int numberOfBuses = 0;
+    char line[128];
+    while (numberOfBuses < LOAD_TEST_MAX_BUSES && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        LoadTestBus *pBus = &buses[numberOfBuses++];
+        snprintf(pBus->portName, sizeof(pBus->portName), "%s", line);
+        initBmsContext(&pBus->bms);
+        pBus->bms.maxBmsAddress = g_max_bms_address;
+        pBus->bms.hostAddressBase = g_host_address_base;
+        pBus->bms.alignSamples = g_align_samples;
+        pBus->bms.verbose = g_verbose;
+        setBmsSampleCallback(&pBus->bms, onLoadTestSample, pBus);
+    }
+    fclose(fp);
+
+    printf("Polling %d buses for %d seconds\n", numberOfBuses, g_run_time_s);
+
+    // Discovery is included in the CPU figure, the run time only counts once polling starts
+    double cpuStart = getCpuSeconds();
+    long long startUs = getMonotonicUs();
+    for (int b = 0; b < numberOfBuses; b++) {
+        pthread_create(&threads[b], NULL, pollBus, &buses[b]);
+    }
+    for (int b = 0; b < numberOfBuses; b++) {
+        pthread_join(threads[b], NULL);
+    }
+    double elapsedS = (getMonotonicUs() - startUs) / 1e6;
+    double cpuS = getCpuSeconds() - cpuStart;
+
+    // Totals
+    int packs = 0;
+    unsigned long expected = 0;
+    unsigned long decoded = 0;
+    unsigned long cycles = 0;
+    unsigned long completeRows = 0;
+    long long cycleTimeUs = 0;
+    unsigned long decodedPerCommand[G_NUMBER_OF_COMMANDS] = {0};
+
+    for (int b = 0; b < numberOfBuses; b++) {
+        LoadTestBus *pBus = &buses[b];
+        packs += pBus->numberOfPacks;
+        expected += pBus->requested;
+        cycles += pBus->cyclesComplete;
+        completeRows += pBus->completeRows;
+        cycleTimeUs += pBus->cycleTimeUs;
+        for (int i = 0; i < G_NUMBER_OF_COMMANDS; i++) {
+            decoded += pBus->decoded[i];
+            decodedPerCommand[i] += pBus->decoded[i];
+        }
+    }
+
+    if (packs == 0 || cycles == 0) {
+        printf("No data was collected\n");
+        return 1;
+    }
+
+    printf("\nBuses:                 %d\n", numberOfBuses);
+    printf("Packs:                 %d\n", packs);
+    printf("Elapsed:               %.1f s\n", elapsedS);
+    printf("Rows:                  %lu (%.1f rows/s, %.2f rows/s per pack)\n", cycles, cycles / elapsedS, cycles / elapsedS / packs);
+    printf("Mean cycle time:       %.1f ms\n", cycleTimeUs / 1000.0 / cycles);
+    printf("Samples decoded:       %lu of %lu (%.1f samples/s)\n", decoded, expected, decoded / elapsedS);
+    printf("Sample loss:           %.3f %%\n", expected > 0 ? 100.0 * ((long long)expected - (long long)decoded) / expected : 0);
+    printf("Incomplete rows:       %.3f %%\n", 100.0 * (cycles - completeRows) / cycles);
+    printf("CPU:                   %.2f s (%.3f %% of one core per pack)\n", cpuS, 100.0 * cpuS / elapsedS / packs);
+
+    printf("\nCommand  Decoded\n");
+    for (int i = 0; i < G_NUMBER_OF_COMMANDS; i++) {
+        printf("0x%02X     %lu\n", READ_BAT_TOTAL_VOLTAGE_CURRENT_SOC + i, decodedPerCommand[i]);
+    }
+    return 0;
+}